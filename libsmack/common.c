@@ -30,23 +30,55 @@
 #include <sys/stat.h>
 #include <sys/smack.h>
 
+/* Files opened at once when a directory is loaded in parallel */
+#define FDS_BATCH 256
+
 typedef int (*add_func)(void *smack, int fd);
+typedef int (*add_many_func)(void *smack, const int *fds, int cnt);
+
+static struct smack_accesses *kernel_rules(void)
+{
+	struct smack_accesses *rules;
+
+	if (smack_accesses_new_from_kernel(&rules)) {
+		fputs("Reading rules from the kernel failed.\n", stderr);
+		return NULL;
+	}
+
+	return rules;
+}
 
 int clear(void)
 {
+	struct smack_accesses *rules;
 	int ret;
-	const char * smack_mnt;
-	char path[PATH_MAX];
 
-	smack_mnt = smack_smackfs_path();
-	if (!smack_mnt)
+	rules = kernel_rules();
+	if (rules == NULL)
 		return -1;
 
-	ret = snprintf(path, sizeof(path), "%s/load2", smack_mnt);
-	if (ret >= (int) sizeof(path))
+	ret = smack_accesses_clear(rules);
+	if (ret)
+		fputs("Clearing rules failed.\n", stderr);
+
+	smack_accesses_free(rules);
+	return ret;
+}
+
+int dump_rules(void)
+{
+	struct smack_accesses *rules;
+	int ret;
+
+	rules = kernel_rules();
+	if (rules == NULL)
 		return -1;
 
-	ret = apply_rules(path, 1);
+	ret = smack_accesses_save(rules, STDOUT_FILENO);
+	if (ret)
+		fputs("Writing rules failed.\n", stderr);
+
+	smack_accesses_free(rules);
 	return ret;
 }
 
@@ -69,10 +101,34 @@ static int d_type(int dirfd, const char* path)
 	}
 }
 
-static int apply_path(const char *path, void *smack, add_func func)
+static int flush_fds(const char *path, void *smack, add_many_func func,
+		     int *fds, int *cnt)
+{
+	int ret;
+	int i;
+
+	ret = func(smack, fds, *cnt);
+	if (ret < 0)
+		fprintf(stderr, "Reading from '%s' failed.\n", path);
+
+	for (i = 0; i < *cnt; i++)
+		close(fds[i]);
+	*cnt = 0;
+	return ret;
+}
+
+/*
+ * Reads path, a file or a directory of files, into smack. Directory
+ * entries are passed to func one by one, or to many_func in batches
+ * if it is given.
+ */
+static int apply_path(const char *path, void *smack, add_func func,
+		      add_many_func many_func)
 {
 	DIR *dir;
 	struct dirent *dent;
+	int fds[FDS_BATCH];
+	int fds_cnt = 0;
 	int dfd;
 	int fd;
 	int ret = 0;
@@ -100,15 +156,15 @@ static int apply_path(const char *path, void *smack, add_func func)
 			if (dtype == DT_UNKNOWN) {
 				fprintf(stderr, "'%s' file type is unknown\n",
 					dent->d_name);
-				closedir(dir);
-				return -1;
+				ret = -1;
+				break;
 			}
 
 			if (dtype != DT_REG) {
 				fprintf(stderr, "'%s' is a non-regular file\n",
 					dent->d_name);
-				closedir(dir);
-				return -1;
+				ret = -1;
+				break;
 			}
 
 			fd = openat(dfd, dent->d_name, O_RDONLY);
@@ -119,6 +175,17 @@ static int apply_path(const char *path, void *smack, add_func func)
 				break;
 			}
 
+			if (many_func) {
+				fds[fds_cnt++] = fd;
+				if (fds_cnt == FDS_BATCH) {
+					ret = flush_fds(path, smack, many_func,
+							fds, &fds_cnt);
+					if (ret < 0)
+						break;
+				}
+				continue;
+			}
+
 			ret = func(smack, fd);
 			close(fd);
 			if (ret < 0) {
@@ -128,6 +195,11 @@ static int apply_path(const char *path, void *smack, add_func func)
 			}
 		}
 
+		if (ret == 0 && fds_cnt > 0)
+			ret = flush_fds(path, smack, many_func, fds, &fds_cnt);
+		while (fds_cnt > 0)
+			close(fds[--fds_cnt]);
+
 		closedir(dir);
 		return ret;
 	}
@@ -152,21 +224,47 @@ static int apply_path(const char *path, void *smack, add_func func)
 	return ret;
 }
 
-int apply_rules(const char *path, int clear)
+static void print_stats(struct smack_accesses *rules)
 {
-	struct smack_accesses *rules = NULL;
-	int ret;
+	struct smack_accesses_stats stats = {.size = sizeof(stats)};
 
-	if (smack_accesses_new(&rules)) {
-		fputs("Out of memory.\n", stderr);
-		return -1;
+	if (smack_accesses_get_stats(rules, &stats)) {
+		fputs("Getting statistics failed.\n", stderr);
+		return;
 	}
 
-	ret = apply_path(path, rules, (add_func) smack_accesses_add_from_file);
-	if (ret) {
-		smack_accesses_free(rules);
-		return ret;
-	}
+	fprintf(stderr,
+		"labels %u\n"
+		"long_labels %u\n"
+		"rules %llu\n"
+		"merged_rules %llu\n"
+		"label_bytes %llu\n"
+		"rule_bytes %llu\n"
+		"dict_size %u\n"
+		"dict_probe_avg %.2f\n"
+		"dict_probe_max %u\n"
+		"load_rules %llu\n"
+		"load_bytes %llu\n"
+		"change_rules %llu\n"
+		"change_bytes %llu\n"
+		"writes %llu\n"
+		"write_retries %llu\n"
+		"parse_us %llu\n"
+		"merge_us %llu\n"
+		"format_us %llu\n"
+		"write_us %llu\n",
+		stats.labels, stats.long_labels, stats.rules,
+		stats.merged_rules, stats.label_bytes, stats.rule_bytes,
+		stats.dict_size, stats.dict_probe_avg, stats.dict_probe_max,
+		stats.load_rules, stats.load_bytes, stats.change_rules,
+		stats.change_bytes, stats.writes, stats.write_retries,
+		stats.parse_ns / 1000, stats.merge_ns / 1000,
+		stats.format_ns / 1000, stats.write_ns / 1000);
+}
+
+static int apply_accesses(struct smack_accesses *rules, int clear)
+{
+	int ret;
 
 	if (clear) {
 		ret = smack_accesses_clear(rules);
@@ -178,8 +276,165 @@ int apply_rules(const char *path, int clear)
 			fputs("Applying rules failed.\n", stderr);
 	}
 
+	return ret;
+}
+
+static struct smack_accesses *read_rules(const char *path, int jobs)
+{
+	struct smack_accesses *rules = NULL;
+	add_many_func many_func = NULL;
+
+	if (smack_accesses_new(&rules)) {
+		fputs("Out of memory.\n", stderr);
+		return NULL;
+	}
+
+	if (jobs != 1) {
+		if (smack_accesses_set_threads(rules, jobs)) {
+			smack_accesses_free(rules);
+			return NULL;
+		}
+		many_func = (add_many_func) smack_accesses_add_from_files;
+	}
+
+	if (apply_path(path, rules, (add_func) smack_accesses_add_from_file,
+		       many_func)) {
+		smack_accesses_free(rules);
+		return NULL;
+	}
+
+	return rules;
+}
+
+int apply_rules(const char *path, int clear, int jobs, int stats)
+{
+	struct smack_accesses *rules;
+	int ret;
+
+	rules = read_rules(path, jobs);
+	if (rules == NULL)
+		return -1;
+
+	ret = apply_accesses(rules, clear);
+	if (stats)
+		print_stats(rules);
 	smack_accesses_free(rules);
-	return 0;
+	return ret;
+}
+
+struct stream_rules {
+	struct smack_session *session;
+	size_t max_memory;
+	int clear;
+};
+
+static int stream_file(struct stream_rules *stream, int fd)
+{
+	if (stream->clear)
+		return smack_session_clear_from_file(stream->session, fd,
+						     stream->max_memory);
+
+	return smack_session_apply_from_file(stream->session, fd,
+					     stream->max_memory);
+}
+
+int apply_rules_stream(const char *path, int clear, size_t max_memory)
+{
+	struct stream_rules stream = {
+		.max_memory = max_memory,
+		.clear = clear,
+	};
+	int ret;
+
+	if (smack_session_new(&stream.session)) {
+		fputs("Opening SmackFS failed.\n", stderr);
+		return -1;
+	}
+
+	ret = apply_path(path, &stream, (add_func) stream_file, NULL);
+	if (ret)
+		fputs(clear ? "Clearing rules failed.\n" :
+		      "Applying rules failed.\n", stderr);
+
+	smack_session_free(stream.session);
+	return ret;
+}
+
+int reload_rules(const char *path, int jobs, int stats)
+{
+	struct smack_accesses *old_rules;
+	struct smack_accesses *rules;
+	int ret;
+
+	old_rules = kernel_rules();
+	if (old_rules == NULL)
+		return -1;
+
+	rules = read_rules(path, jobs);
+	if (rules == NULL) {
+		smack_accesses_free(old_rules);
+		return -1;
+	}
+
+	ret = smack_accesses_apply_diff(old_rules, rules);
+	if (ret)
+		fputs("Applying rules failed.\n", stderr);
+	if (stats)
+		print_stats(rules);
+
+	smack_accesses_free(rules);
+	smack_accesses_free(old_rules);
+	return ret;
+}
+
+int apply_compiled(const char *path, int clear, int stats)
+{
+	struct smack_accesses *rules = NULL;
+	int ret;
+
+	if (smack_accesses_new(&rules)) {
+		fputs("Out of memory.\n", stderr);
+		return -1;
+	}
+
+	ret = apply_path(path, rules, (add_func) smack_accesses_load_compiled,
+			 NULL);
+	if (ret == 0) {
+		ret = apply_accesses(rules, clear);
+		if (stats)
+			print_stats(rules);
+	}
+
+	smack_accesses_free(rules);
+	return ret;
+}
+
+int compile_rules(const char *path, const char *image, int jobs)
+{
+	struct smack_accesses *rules;
+	int fd;
+	int ret;
+
+	rules = read_rules(path, jobs);
+	if (rules == NULL)
+		return -1;
+
+	fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "open() failed for '%s' : %s\n", image,
+			strerror(errno));
+		smack_accesses_free(rules);
+		return -1;
+	}
+
+	ret = smack_accesses_save_compiled(rules, fd);
+	if (close(fd) && ret == 0)
+		ret = -1;
+	if (ret)
+		fprintf(stderr, "Writing to '%s' failed.\n", image);
+
+	smack_accesses_free(rules);
+	return ret;
 }
 
 int apply_cipso(const char *path)
@@ -193,7 +448,8 @@ int apply_cipso(const char *path)
 		return -1;
 	}
 
-	ret = apply_path(path, cipso, (add_func) smack_cipso_add_from_file);
+	ret = apply_path(path, cipso, (add_func) smack_cipso_add_from_file,
+			 NULL);
 	if (ret) {
 		smack_cipso_free(cipso);
 		return ret;
@@ -208,3 +464,40 @@ int apply_cipso(const char *path)
 
 	return 0;
 }
+
+int load_policy(int diff, int stats)
+{
+	int fd;
+
+	if (!smack_smackfs_path()) {
+		fprintf(stderr, "SmackFS is not mounted.\n");
+		return -1;
+	}
+
+	if (diff) {
+		if (reload_rules(ACCESSES_D_PATH, 1, stats))
+			return -1;
+	} else {
+		if (clear())
+			return -1;
+
+		if (apply_rules(ACCESSES_D_PATH, 0, 1, stats))
+			return -1;
+	}
+
+	if (apply_cipso(CIPSO_D_PATH))
+		return -1;
+
+	fd = open(ONLYCAP_PATH, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (smack_set_onlycap_from_file(fd)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
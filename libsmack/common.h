@@ -21,12 +21,20 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stddef.h>
+
 #define ACCESSES_D_PATH "/etc/smack/accesses.d"
 #define CIPSO_D_PATH "/etc/smack/cipso.d"
 #define ONLYCAP_PATH "/etc/smack/onlycap"
 
 int clear(void);
-int apply_rules(const char *path, int clear);
+int dump_rules(void);
+int apply_rules(const char *path, int clear, int jobs, int stats);
+int apply_rules_stream(const char *path, int clear, size_t max_memory);
+int reload_rules(const char *path, int jobs, int stats);
+int apply_compiled(const char *path, int clear, int stats);
+int compile_rules(const char *path, const char *image, int jobs);
 int apply_cipso(const char *path);
+int load_policy(int diff, int stats);
 
 #endif // COMMON_H
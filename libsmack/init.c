@@ -27,26 +27,55 @@
 #include <stdio.h>
 #include <stdio_ext.h>
 #include <dlfcn.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
 #include <sys/statvfs.h>
 #include <sys/vfs.h>
 #include <stdint.h>
 #include <limits.h>
 #include <pthread.h>
+#include <linux/capability.h>
+#include "probes.h"
 
 #define SMACK_MAGIC	0x43415d53 /* "SMAC" */
 #define SMACKFS		"smackfs"
 #define SMACKFSMNT	"/sys/fs/smackfs/"
 #define OLDSMACKFSMNT	"/smack"
+#define SMACKFS_ENV	"LIBSMACK_SMACKFS"
+#define SMACKFS_EMULATED "emulated"
 
 char *smackfs_mnt = NULL;
 int smackfs_mnt_dirfd = -1;
+/* Set when a directory or the emulation stands in for smackfs */
+int smackfs_directory = 0;
+int smackfs_emulated = 0;
 
 static pthread_mutex_t smackfs_mnt_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Backend given to smack_smackfs_set_backend(), NULL for the kernel */
+static char *smackfs_backend = NULL;
+static int smackfs_backend_set = 0;
 
 static int verify_smackfs_mnt(const char *mnt);
+static int env_backend_allowed(void);
 static int smackfs_exists(void);
+static int find_smackfs_mnt(void);
+static int backend_smackfs_mnt(const char *backend);
 
 int init_smackfs_mnt(void)
+{
+	int ret;
+
+	if (smackfs_mnt)
+		return 0;
+
+	SMACK_PROBE0(init_smackfs_entry);
+	ret = find_smackfs_mnt();
+	SMACK_PROBE2(init_smackfs_return, ret, smackfs_mnt);
+
+	return ret;
+}
+
+static int find_smackfs_mnt(void)
 {
 	char *buf = NULL;
 	char *startp;
@@ -54,8 +83,16 @@ int init_smackfs_mnt(void)
 	FILE *fp = NULL;
 	size_t len;
 	ssize_t num;
+	const char *backend;
 	int ret = 0;
 
+	if (smackfs_backend_set)
+		backend = smackfs_backend;
+	else
+		backend = env_backend_allowed() ? getenv(SMACKFS_ENV) : NULL;
+	if (backend != NULL && *backend != '\0')
+		return backend_smackfs_mnt(backend);
+
 	if (smackfs_mnt ||
 	    verify_smackfs_mnt(SMACKFSMNT) == 0 ||
 	    verify_smackfs_mnt(OLDSMACKFSMNT) == 0)
@@ -95,6 +132,85 @@ int init_smackfs_mnt(void)
 	return ret;
 }
 
+/*
+ * Tells whether the backend may be taken from the environment. Set-id
+ * programs, root and holders of CAP_MAC_ADMIN, which all may change the
+ * real policy, always use the kernel.
+ */
+static int env_backend_allowed(void)
+{
+	struct __user_cap_header_struct header = {
+		.version = _LINUX_CAPABILITY_VERSION_3,
+	};
+	struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+	if (getauxval(AT_SECURE) || getuid() == 0 || geteuid() == 0)
+		return 0;
+
+	/* Better safe than fooled if the capabilities cannot be told */
+	if (syscall(SYS_capget, &header, data) == -1)
+		return 0;
+
+	return !(data[CAP_TO_INDEX(CAP_MAC_ADMIN)].effective &
+		 CAP_TO_MASK(CAP_MAC_ADMIN));
+}
+
+/*
+ * Uses the emulation or a directory of files in place of smackfs. Nothing
+ * checks that the directory holds the files the library expects.
+ */
+static int backend_smackfs_mnt(const char *backend)
+{
+	int emulated = !strcmp(backend, SMACKFS_EMULATED);
+	int fd = -1;
+
+	if (!emulated) {
+		fd = open(backend, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+	}
+
+	pthread_mutex_lock(&smackfs_mnt_lock);
+	if (smackfs_mnt == NULL) {
+		smackfs_mnt = strdup(backend);
+		smackfs_mnt_dirfd = fd;
+		smackfs_emulated = emulated;
+		smackfs_directory = !emulated;
+	} else if (fd >= 0) {
+		/* Some other thread won the race. */
+		close(fd);
+	}
+	pthread_mutex_unlock(&smackfs_mnt_lock);
+
+	return smackfs_mnt != NULL ? 0 : -1;
+}
+
+int smack_smackfs_set_backend(const char *backend)
+{
+	char *copy = NULL;
+
+	if (backend != NULL) {
+		copy = strdup(backend);
+		if (copy == NULL)
+			return -1;
+	}
+
+	pthread_mutex_lock(&smackfs_mnt_lock);
+	if (smackfs_mnt_dirfd >= 0)
+		close(smackfs_mnt_dirfd);
+	free(smackfs_mnt);
+	smackfs_mnt = NULL;
+	smackfs_mnt_dirfd = -1;
+	smackfs_directory = 0;
+	smackfs_emulated = 0;
+	free(smackfs_backend);
+	smackfs_backend = copy;
+	smackfs_backend_set = 1;
+	pthread_mutex_unlock(&smackfs_mnt_lock);
+
+	return init_smackfs_mnt();
+}
+
 static int verify_smackfs_mnt(const char *mnt)
 {
 	struct statfs sfbuf;
@@ -166,4 +282,6 @@ static void fini_lib(void)
 		close(smackfs_mnt_dirfd);
 	free(smackfs_mnt);
 	smackfs_mnt = NULL;
+	free(smackfs_backend);
+	smackfs_backend = NULL;
 }
@@ -22,18 +22,27 @@
 
 #include "sys/smack.h"
 #include "common.h"
+#include "probes.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/xattr.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_LABEL_SPAN_SIMD 1
+#include <immintrin.h>
+#endif
+
 #define SELF_LABEL_FILE "/proc/self/attr/smack/current"
 #define OLD_SELF_LABEL_FILE "/proc/self/attr/current"
 #define PID_LABEL_FILE "/proc/%d/attr/smack/current"
@@ -43,7 +52,10 @@
 #define ACC_LEN 6
 #define LOAD_LEN (2 * (SMACK_LABEL_LEN + 1) + 2 * ACC_LEN + 1)
 #define KERNEL_LONG_FORMAT "%s %s %s"
+/* Layout of short format rules, written by short_rule_render() */
 #define KERNEL_SHORT_FORMAT "%-23s %-23s %5.5s"
+#define SHORT_ACC_LEN 5
+#define SHORT_RULE_LEN (2 * (SHORT_LABEL_LEN + 1) + SHORT_ACC_LEN)
 #define KERNEL_MODIFY_FORMAT "%s %s %s %s"
 
 #define LEVEL_MAX 255
@@ -68,11 +80,66 @@
 #define ACCESS_TYPE_L 0x20
 
 #define ACCESS_TYPE_ALL ((1 << ACC_LEN) - 1)
+/* Marks a merged pair that is dealt with, outside of the access bits */
+#define PERM_DONE (1 << ACC_LEN)
+
+/* Marks characters that may appear in an access string */
+#define ACCESS_VALID 0x80
+
+#define READ_CHUNK_SIZE (1024 * 1024)
+/* Smallest part of a file worth handing to a parser thread */
+#define PARSE_MIN_CHUNK (256 * 1024)
+
+#define DICT_MIN_SIZE 256
+#define DICT_GOLDEN 0x9e3779b1U
+
+/* Buffers of the pipelined writer, two of them are being filled */
+#define WRITE_RING_SIZE 8
+#define WRITE_CHUNK_MAX (1 << 26)
+
+/* Shared policy generation, bumped whenever rules are written */
+#define GENERATION_DIR "/run/smack"
+#define GENERATION_PATH GENERATION_DIR "/generation"
+
+/* Subject and object together must fit into a cache slot */
+#define CACHE_KEY_LEN 48
+#define CACHE_MAX_ENTRIES (1 << 24)
+
+#define PAIRS_MIN_SIZE 64
+#define PAIRS_GOLDEN 0x9e3779b97f4a7c15ULL
+#define PAIR_EMPTY UINT32_MAX
+/* Marks a fold index that points into new_rules instead of rules */
+#define FOLD_NEW 0x80000000U
+
+#define LABEL_POOL_MIN_SIZE 4096
+
+#define COMPILED_MAGIC "SMACKPOL"
+#define COMPILED_VERSION 1
+#define COMPILED_BYTE_ORDER 0x01020304U
+
+static const uint8_t access_type_table[256] = {
+	['r'] = ACCESS_VALID | ACCESS_TYPE_R,
+	['R'] = ACCESS_VALID | ACCESS_TYPE_R,
+	['w'] = ACCESS_VALID | ACCESS_TYPE_W,
+	['W'] = ACCESS_VALID | ACCESS_TYPE_W,
+	['x'] = ACCESS_VALID | ACCESS_TYPE_X,
+	['X'] = ACCESS_VALID | ACCESS_TYPE_X,
+	['a'] = ACCESS_VALID | ACCESS_TYPE_A,
+	['A'] = ACCESS_VALID | ACCESS_TYPE_A,
+	['t'] = ACCESS_VALID | ACCESS_TYPE_T,
+	['T'] = ACCESS_VALID | ACCESS_TYPE_T,
+	['l'] = ACCESS_VALID | ACCESS_TYPE_L,
+	['L'] = ACCESS_VALID | ACCESS_TYPE_L,
+	['-'] = ACCESS_VALID,
+};
 
-#define DICT_HASH_SIZE 4096
+/* Access string of every access code, filled by init_access_strs() */
+static char access_strs[ACCESS_TYPE_ALL + 1][ACC_LEN + 1];
 
 extern char *smackfs_mnt;
 extern int smackfs_mnt_dirfd;
+extern int smackfs_directory;
+extern int smackfs_emulated;
 
 extern int init_smackfs_mnt(void);
 
@@ -85,23 +152,46 @@ union smack_perm {
 };
 
 struct smack_rule {
+	uint32_t object_id;
 	union smack_perm perm;
-	int object_id;
-	struct smack_rule *next_rule;
 };
 
+/* Rule waiting to be sorted into the per subject rule table */
+struct smack_new_rule {
+	uint32_t subject_id;
+	struct smack_rule rule;
+};
+
+/* Label of a handle, its id is the index in labels. The null terminated
+ * string is at offset in the label pool of the handle. */
 struct smack_label {
+	uint32_t offset;
 	uint8_t len;
+};
+
+/* Slot of the open addressing (Robin Hood) label dictionary. The full hash
+ * and length are kept next to the id so that most mismatches are rejected
+ * without touching the label string. */
+struct smack_dict_slot {
+	uint32_t hash;
+	uint16_t len;
 	int id;
-	char *label;
-	struct smack_rule *first_rule;
-	struct smack_rule *last_rule;
-	struct smack_label *next_label;
 };
 
-struct smack_hash_entry {
-	struct smack_label *first;
-	struct smack_label *last;
+/* Slot of the (subject, object) index used by smack_accesses_check() */
+struct smack_pair_slot {
+	uint32_t subject_id;
+	uint32_t object_id;
+	int32_t allow_code;
+};
+
+/* Slot of the (subject, object) index used to collapse repeated pairs. A
+ * rule of the rule table is found by its position among the rules of its
+ * subject, which accesses_finalize() does not change. */
+struct smack_fold_slot {
+	uint32_t subject_id;
+	uint32_t object_id;
+	uint32_t index;
 };
 
 struct smack_accesses {
@@ -109,10 +199,81 @@ struct smack_accesses {
 	int labels_cnt;
 	int labels_alloc;
 	int page_size;
-	struct smack_label **labels;
-	struct smack_hash_entry *label_hash;
+	int threads;
+	int write_chunk;
+	int write_pipelined;
+	struct smack_label *labels;
+	struct smack_dict_slot *dict;
+	/* Strings of all labels, one after another in the order of ids */
+	char *label_pool;
+	uint32_t label_pool_size;
+	uint32_t label_pool_alloc;
+	uint32_t dict_size;
+	int dict_shift;
 	union smack_perm *merge_perms;
 	int *merge_object_ids;
+	/* Rules in compressed sparse row layout: the rules of subject id i
+	 * are rules[rules_start[i]] .. rules[rules_start[i + 1] - 1], in the
+	 * order they were added. rules_start has rules_labels_cnt + 1
+	 * entries, labels added later have no rules there. */
+	struct smack_rule *rules;
+	uint32_t *rules_start;
+	uint32_t rules_cnt;
+	int rules_labels_cnt;
+	/* Rules added since the last accesses_finalize() */
+	struct smack_new_rule *new_rules;
+	uint32_t new_rules_cnt;
+	uint32_t new_rules_alloc;
+	/* Merged access of every (subject, object) pair, built on the first
+	 * smack_accesses_check() after rules have been added */
+	struct smack_pair_slot *pairs;
+	uint32_t pairs_mask;
+	int pairs_ready;
+	pthread_mutex_t pairs_lock;
+	/* Last rule of every (subject, object) pair when repeated pairs are
+	 * collapsed, built on the first rule added after accesses_finalize() */
+	int collapse;
+	struct smack_fold_slot *folds;
+	uint32_t folds_cnt;
+	uint32_t folds_mask;
+	int folds_ready;
+	/* Parse time and counters of the last apply */
+	struct smack_accesses_stats stats;
+};
+
+static inline const char *label_str(struct smack_accesses *handle, int id)
+{
+	return handle->label_pool + handle->labels[id].offset;
+}
+
+static inline uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Header of a compiled policy image. It is followed by labels_cnt label
+ * records, the labels_cnt + 1 entries of rules_start, rules_cnt rules and
+ * the null terminated label strings. Everything is in host byte order,
+ * crc is the CRC-32 of all the data after the header. */
+struct smack_compiled_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t labels_cnt;
+	uint32_t rules_cnt;
+	uint32_t strings_size;
+	uint32_t has_long;
+	uint32_t crc;
+	uint32_t reserved;
+};
+
+struct smack_compiled_label {
+	uint32_t offset;
+	uint32_t hash;
+	uint32_t len;
 };
 
 struct cipso_mapping {
@@ -129,25 +290,141 @@ struct smack_cipso {
 	struct cipso_mapping *last;
 };
 
+/* Per thread state of smack_have_access() */
+struct smack_access_state {
+	int fd;
+	int use_long;
+	int probed;
+	/* Cleared once the kernel refuses a second query on one open file */
+	int reuse;
+	/* The open file has already answered a query */
+	int used;
+	char buf[LOAD_LEN + 1];
+};
+
+/* Slot of the access decision cache. Writers make seq odd while they
+ * change the slot, readers retry nothing and treat a torn read as a
+ * miss. The key is the subject followed by the object. */
+struct smack_cache_slot {
+	uint32_t seq;
+	uint32_t generation;
+	uint32_t hash;
+	uint8_t subject_len;
+	uint8_t object_len;
+	int8_t request;
+	int8_t result;
+	char key[CACHE_KEY_LEN];
+};
+
+/* Access decision cache, published whole so that readers always see the
+ * mask that belongs to the slots */
+struct smack_access_cache {
+	uint32_t mask;
+	struct smack_cache_slot slots[];
+};
+
+/* Rules are written in chunks of whole rules of at most chunk bytes. With
+ * a ring, full chunks are handed to the writer thread instead. */
+/* Counters of the writes to one smackfs file */
+struct write_stats {
+	uint64_t rules;
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t retries;
+	uint64_t write_ns;
+	/* Time the formatting thread spent in buffer_flush() */
+	uint64_t flush_ns;
+};
+
 struct smack_file_buffer {
 	int fd;
 	int pos;
-	int flush_pos;
+	int chunk;
 	int size;
 	char *buf;
+	struct write_ring *ring;
+	struct write_stats *stats;
+};
+
+struct write_job {
+	int fd;
+	int len;
+	char *buf;
+	struct write_stats *stats;
+};
+
+/* Chunks queued for the writer thread in order, and the empty buffers */
+struct write_ring {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct write_job jobs[WRITE_RING_SIZE];
+	int head;
+	int queued;
+	char *free_bufs[WRITE_RING_SIZE];
+	int free_cnt;
+	int done;
+	int error;
+	int size;
+	char *bufs[WRITE_RING_SIZE];
+};
+
+/* Kernel interfaces probed once and kept open between calls */
+struct smack_session {
+	struct smack_file_buffer load_buffer;
+	struct smack_file_buffer change_buffer;
+	int use_long;
+	int multiline;
+	const char *self_label_file;
+	struct smack_access_state access;
 };
 
+static int smackfs_open(const char *name, int flags);
+static ssize_t smackfs_write(int fd, const void *buf, size_t len);
 static int open_smackfs_file(const char *long_name, const char *short_name,
 			     mode_t mode, int *use_long);
-static int accesses_apply(struct smack_accesses *handle, int clear);
+static int accesses_apply(struct smack_accesses *handle,
+			  struct smack_accesses *old_handle, int clear);
 static int accesses_print(struct smack_accesses *handle,
 			  int clear, int use_long, int multiline,
 			  struct smack_file_buffer *load_buffer,
 			  struct smack_file_buffer *change_buffer);
-static inline ssize_t get_label(char *dest, const char *src, unsigned int *hash);
+static int accesses_print_diff(struct smack_accesses *old_handle,
+			       struct smack_accesses *new_handle,
+			       int use_long, int multiline,
+			       struct smack_file_buffer *load_buffer,
+			       struct smack_file_buffer *change_buffer);
+static inline ssize_t get_label(char *dest, const char *src, uint32_t *hash);
 static inline int str_to_access_code(const char *str);
-static inline void access_code_to_str(unsigned code, char *str);
-static struct smack_label *label_add(struct smack_accesses *handle, const char *src);
+static inline int short_rule_render(char *buf, const char *subject, int slen,
+				    const char *object, int olen,
+				    const char *access_str);
+static int label_span_scalar(const char *src, const char *end, uint32_t *hash);
+/* Best label_span_*() variant for the CPU, picked by init_label_span() */
+static int (*label_span)(const char *src, const char *end, uint32_t *hash) =
+	label_span_scalar;
+static int label_add(struct smack_accesses *handle, const char *src);
+static int label_add_span(struct smack_accesses *handle, const char *label,
+			  int len, uint32_t hash);
+static inline int is_label_known(struct smack_accesses *handle,
+				 const char *label, int len, uint32_t hash);
+static int dict_resize(struct smack_accesses *handle, uint32_t size);
+static inline uint32_t dict_home(struct smack_accesses *handle, uint32_t hash);
+static int subject_merge(struct smack_accesses *handle, int x, int clear);
+static int label_pool_reserve(struct smack_accesses *handle, uint32_t size);
+static int accesses_finalize(struct smack_accesses *handle);
+static size_t accesses_rules_memory(struct smack_accesses *handle);
+static void accesses_reset(struct smack_accesses *handle);
+static int accesses_merge(struct smack_accesses *dst,
+			  struct smack_accesses *src);
+static int accesses_load_image(struct smack_accesses *handle,
+			       const char *image, size_t size);
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+static int pairs_build(struct smack_accesses *handle);
+static void generation_bump(void);
+static int session_write(struct smack_session *session,
+			 struct smack_accesses *handle,
+			 struct smack_accesses *old_handle, int clear);
 
 int smack_accesses_new(struct smack_accesses **accesses)
 {
@@ -158,7 +435,7 @@ int smack_accesses_new(struct smack_accesses **accesses)
 		return -1;
 
 	result->labels_alloc = 128;
-	result->labels = malloc(result->labels_alloc * sizeof(struct smack_label *));
+	result->labels = malloc(result->labels_alloc * sizeof(struct smack_label));
 	if (result->labels == NULL)
 		goto err_out;
 	result->merge_perms = malloc(result->labels_alloc * sizeof(union smack_perm));
@@ -168,11 +445,13 @@ int smack_accesses_new(struct smack_accesses **accesses)
 	if (result->merge_object_ids == NULL)
 		goto err_out;
 
-	result->label_hash = calloc(DICT_HASH_SIZE, sizeof(struct smack_hash_entry));
-	if (result->label_hash == NULL)
+	if (dict_resize(result, DICT_MIN_SIZE))
 		goto err_out;
 
 	result->page_size = sysconf(_SC_PAGESIZE);
+	result->threads = 1;
+	result->write_chunk = result->page_size;
+	pthread_mutex_init(&result->pairs_lock, NULL);
 	*accesses = result;
 	return 0;
 
@@ -186,25 +465,17 @@ err_out:
 
 void smack_accesses_free(struct smack_accesses *handle)
 {
-	struct smack_rule *rule;
-	struct smack_rule *next_rule;
-	int i;
-
 	if (handle == NULL)
 		return;
 
-	for (i = 0; i < handle->labels_cnt; ++i) {
-		rule = handle->labels[i]->first_rule;
-		while (rule != NULL) {
-			next_rule = rule->next_rule;
-			free(rule);
-			rule = next_rule;
-		}
-		free(handle->labels[i]->label);
-		free(handle->labels[i]);
-	}
-
-	free(handle->label_hash);
+	free(handle->label_pool);
+	pthread_mutex_destroy(&handle->pairs_lock);
+	free(handle->pairs);
+	free(handle->folds);
+	free(handle->dict);
+	free(handle->new_rules);
+	free(handle->rules_start);
+	free(handle->rules);
 	free(handle->merge_object_ids);
 	free(handle->merge_perms);
 	free(handle->labels);
@@ -213,11 +484,11 @@ void smack_accesses_free(struct smack_accesses *handle)
 
 int smack_accesses_save(struct smack_accesses *handle, int fd)
 {
-	struct smack_file_buffer buffer;
+	struct smack_file_buffer buffer = {.fd = fd};
 	int ret;
 
-	buffer.fd = fd;
-	buffer.size = handle->page_size + LOAD_LEN;
+	buffer.chunk = handle->page_size;
+	buffer.size = buffer.chunk + LOAD_LEN;
 	buffer.buf = malloc(buffer.size);
 	if (buffer.buf == NULL)
 		return -1;
@@ -229,61 +500,214 @@ int smack_accesses_save(struct smack_accesses *handle, int fd)
 
 int smack_accesses_apply(struct smack_accesses *handle)
 {
-	return accesses_apply(handle, 0);
+	return accesses_apply(handle, NULL, 0);
+}
+
+int smack_accesses_apply_diff(struct smack_accesses *old_handle,
+			      struct smack_accesses *new_handle)
+{
+	return accesses_apply(new_handle, old_handle, 0);
 }
 
 int smack_accesses_clear(struct smack_accesses *handle)
 {
-	return accesses_apply(handle, 1);
+	return accesses_apply(handle, NULL, 1);
 }
 
-static int accesses_add(struct smack_accesses *handle, const char *subject,
-		 const char *object, const char *allow_access_type,
-		 const char *deny_access_type)
+static struct smack_fold_slot *fold_find(struct smack_accesses *handle,
+					 uint32_t subject_id,
+					 uint32_t object_id)
 {
-	struct smack_rule *rule;
-	struct smack_label *subject_label;
-	struct smack_label *object_label;
+	struct smack_fold_slot *slot;
+	uint64_t key = (uint64_t) subject_id << 32 | object_id;
+	uint32_t pos = (key * PAIRS_GOLDEN) >> 32 & handle->folds_mask;
+
+	for (;; pos = (pos + 1) & handle->folds_mask) {
+		slot = &handle->folds[pos];
+		if (slot->subject_id == PAIR_EMPTY ||
+		    (slot->subject_id == subject_id &&
+		     slot->object_id == object_id))
+			return slot;
+	}
+}
+
+/* Makes room for one more pair, keeping the load below 3/4 */
+static int folds_reserve(struct smack_accesses *handle)
+{
+	struct smack_fold_slot *old = handle->folds;
+	struct smack_fold_slot *slot;
+	uint32_t old_size = old ? handle->folds_mask + 1 : 0;
+	uint32_t size = old_size ? old_size : PAIRS_MIN_SIZE;
+	uint32_t i;
+
+	while ((uint64_t) (handle->folds_cnt + 1) * 4 > (uint64_t) size * 3) {
+		if (size == 1U << 31)
+			return -1;
+		size <<= 1;
+	}
+	if (size == old_size)
+		return 0;
 
-	rule = calloc(1, sizeof(struct smack_rule));
-	if (rule == NULL)
+	handle->folds = malloc(size * sizeof(struct smack_fold_slot));
+	if (handle->folds == NULL) {
+		handle->folds = old;
 		return -1;
+	}
+	handle->folds_mask = size - 1;
+	for (i = 0; i < size; ++i)
+		handle->folds[i].subject_id = PAIR_EMPTY;
 
-	subject_label = label_add(handle, subject);
-	if (subject_label == NULL)
-		goto err_out;
-	object_label = label_add(handle, object);
-	if (object_label == NULL)
-		goto err_out;
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].subject_id == PAIR_EMPTY)
+			continue;
+		slot = fold_find(handle, old[i].subject_id, old[i].object_id);
+		*slot = old[i];
+	}
 
-	if (subject_label->len > SHORT_LABEL_LEN ||
-	    object_label->len > SHORT_LABEL_LEN)
-		handle->has_long = 1;
+	free(old);
+	return 0;
+}
 
-	rule->object_id = object_label->id;
+static int fold_set(struct smack_accesses *handle, uint32_t subject_id,
+		    uint32_t object_id, uint32_t index)
+{
+	struct smack_fold_slot *slot;
 
-	rule->perm.allow_code = str_to_access_code(allow_access_type);
-	if (rule->perm.allow_code == -1)
-		goto err_out;
+	if (folds_reserve(handle))
+		return -1;
 
-	if (deny_access_type != NULL) {
-		rule->perm.deny_code = str_to_access_code(deny_access_type);
-		if (rule->perm.deny_code == -1)
-			goto err_out;
-	} else
-		rule->perm.deny_code = ACCESS_TYPE_ALL & ~rule->perm.allow_code;
+	slot = fold_find(handle, subject_id, object_id);
+	if (slot->subject_id == PAIR_EMPTY)
+		++handle->folds_cnt;
+	slot->subject_id = subject_id;
+	slot->object_id = object_id;
+	slot->index = index;
+	return 0;
+}
 
-	if (subject_label->first_rule == NULL) {
-		subject_label->first_rule = subject_label->last_rule = rule;
-	} else {
-		subject_label->last_rule->next_rule = rule;
-		subject_label->last_rule = rule;
+/*
+ * Indexes the rules that are already in the handle. A pair that is there
+ * more than once points to its last rule, later rules of the pair are
+ * folded into that one so that the order of merging does not change.
+ */
+static int folds_build(struct smack_accesses *handle)
+{
+	uint32_t i;
+	int x;
+
+	free(handle->folds);
+	handle->folds = NULL;
+	handle->folds_cnt = 0;
+
+	for (x = 0; x < handle->rules_labels_cnt; ++x)
+		for (i = handle->rules_start[x]; i < handle->rules_start[x + 1]; ++i)
+			if (fold_set(handle, x, handle->rules[i].object_id,
+				     i - handle->rules_start[x]))
+				return -1;
+	for (i = 0; i < handle->new_rules_cnt; ++i)
+		if (fold_set(handle, handle->new_rules[i].subject_id,
+			     handle->new_rules[i].rule.object_id, i | FOLD_NEW))
+			return -1;
+
+	handle->folds_ready = 1;
+	return 0;
+}
+
+/*
+ * Adds a rule by label id. When repeated pairs are collapsed, a rule for a
+ * pair that is already there is merged into the existing rule the way
+ * subject_merge() merges consecutive rules, which leaves the merged access
+ * of the pair the same.
+ */
+static int rule_append(struct smack_accesses *handle, uint32_t subject_id,
+		       uint32_t object_id, union smack_perm perm)
+{
+	struct smack_fold_slot *slot;
+	struct smack_new_rule *rule;
+	struct smack_new_rule *new_rules;
+	union smack_perm *old;
+	uint32_t alloc;
+
+	if (handle->collapse) {
+		if (!handle->folds_ready && folds_build(handle))
+			return -1;
+		if (handle->folds != NULL) {
+			slot = fold_find(handle, subject_id, object_id);
+			if (slot->subject_id != PAIR_EMPTY) {
+				if (slot->index & FOLD_NEW)
+					old = &handle->new_rules[slot->index & ~FOLD_NEW].rule.perm;
+				else
+					old = &handle->rules[handle->rules_start[subject_id] +
+							     slot->index].perm;
+				old->allow_code |=  perm.allow_code;
+				old->allow_code &= ~perm.deny_code;
+				old->deny_code  &= ~perm.allow_code;
+				old->deny_code  |=  perm.deny_code;
+				__atomic_store_n(&handle->pairs_ready, 0,
+						 __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+		if (fold_set(handle, subject_id, object_id,
+			     handle->new_rules_cnt | FOLD_NEW))
+			return -1;
+	}
+
+	if (handle->new_rules_cnt == handle->new_rules_alloc) {
+		alloc = handle->new_rules_alloc ? handle->new_rules_alloc << 1 : 256;
+		new_rules = realloc(handle->new_rules,
+				    alloc * sizeof(struct smack_new_rule));
+		if (new_rules == NULL)
+			return -1;
+		handle->new_rules = new_rules;
+		handle->new_rules_alloc = alloc;
 	}
 
+	rule = &handle->new_rules[handle->new_rules_cnt++];
+	rule->subject_id = subject_id;
+	rule->rule.object_id = object_id;
+	rule->rule.perm = perm;
+
 	return 0;
-err_out:
-	free(rule);
-	return -1;
+}
+
+static int rule_add(struct smack_accesses *handle, int subject_id,
+		    int object_id, union smack_perm perm)
+{
+	if (handle->labels[subject_id].len > SHORT_LABEL_LEN ||
+	    handle->labels[object_id].len > SHORT_LABEL_LEN)
+		handle->has_long = 1;
+
+	return rule_append(handle, subject_id, object_id, perm);
+}
+
+static int accesses_add(struct smack_accesses *handle, const char *subject,
+		 const char *object, const char *allow_access_type,
+		 const char *deny_access_type)
+{
+	union smack_perm perm;
+	int subject_id;
+	int object_id;
+
+	subject_id = label_add(handle, subject);
+	if (subject_id < 0)
+		return -1;
+	object_id = label_add(handle, object);
+	if (object_id < 0)
+		return -1;
+
+	perm.allow_code = str_to_access_code(allow_access_type);
+	if (perm.allow_code == -1)
+		return -1;
+
+	if (deny_access_type != NULL) {
+		perm.deny_code = str_to_access_code(deny_access_type);
+		if (perm.deny_code == -1)
+			return -1;
+	} else
+		perm.deny_code = ACCESS_TYPE_ALL & ~perm.allow_code;
+
+	return rule_add(handle, subject_id, object_id, perm);
 }
 
 int smack_accesses_add(struct smack_accesses *handle, const char *subject,
@@ -302,903 +726,3360 @@ int smack_accesses_add_modify(struct smack_accesses *handle,
 		allow_access_type, deny_access_type);
 }
 
-int smack_accesses_add_from_file(struct smack_accesses *accesses, int fd)
+static inline const char *skip_blanks(const char *p, const char *end)
 {
-	FILE *file = NULL;
-	char *buf = NULL;
-	size_t buf_len = 0;
-	char *ptr;
-	const char *subject, *object, *access, *access2;
-	int newfd;
-	int ret;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		++p;
+	return p;
+}
 
-	newfd = dup(fd);
-	if (newfd == -1)
+static inline int is_token_end(const char *p, const char *end)
+{
+	return p == end || *p == ' ' || *p == '\t' || *p == '\n';
+}
+
+static inline int parse_label(struct smack_accesses *handle,
+			      const char **pos, const char *end)
+{
+	const char *p = skip_blanks(*pos, end);
+	uint32_t hash;
+	int len;
+
+	len = label_span(p, end, &hash);
+	if (len == 0 || len > SMACK_LABEL_LEN || p[0] == '-' ||
+	    !is_token_end(p + len, end))
 		return -1;
 
-	file = fdopen(newfd, "r");
-	if (file == NULL) {
-		close(newfd);
+	*pos = p + len;
+	return label_add_span(handle, p, len, hash);
+}
+
+static inline int parse_access_code(const char **pos, const char *end)
+{
+	const char *p = skip_blanks(*pos, end);
+	unsigned int code = 0;
+	uint8_t type;
+
+	if (is_token_end(p, end))
 		return -1;
+
+	for (; !is_token_end(p, end); ++p) {
+		type = access_type_table[(unsigned char) *p];
+		if (type == 0)
+			return -1;
+		code |= type;
 	}
 
-	while (getline(&buf, &buf_len, file) >= 0) {
-		if (strcmp(buf, "\n") == 0)
+	*pos = p;
+	return code & ACCESS_TYPE_ALL;
+}
+
+/*
+ * Parses the rules in buf, a line at a time, straight from the input
+ * buffer. The last line does not need to be terminated.
+ */
+static int accesses_parse(struct smack_accesses *handle,
+			  const char *buf, const char *end)
+{
+	union smack_perm perm;
+	const char *p = buf;
+	int subject_id;
+	int object_id;
+	int code;
+
+	while (p < end) {
+		if (*p == '\n') {
+			++p;
 			continue;
-		subject = strtok_r(buf, " \t\n", &ptr);
-		object = strtok_r(NULL, " \t\n", &ptr);
-		access = strtok_r(NULL, " \t\n", &ptr);
-		access2 = strtok_r(NULL, " \t\n", &ptr);
+		}
+
+		subject_id = parse_label(handle, &p, end);
+		if (subject_id < 0)
+			return -1;
+		object_id = parse_label(handle, &p, end);
+		if (object_id < 0)
+			return -1;
+
+		code = parse_access_code(&p, end);
+		if (code < 0)
+			return -1;
+		perm.allow_code = code;
+
+		p = skip_blanks(p, end);
+		if (p < end && *p != '\n') {
+			code = parse_access_code(&p, end);
+			if (code < 0)
+				return -1;
+			perm.deny_code = code;
+
+			p = skip_blanks(p, end);
+			if (p < end && *p != '\n')
+				return -1;
+		} else
+			perm.deny_code = ACCESS_TYPE_ALL & ~perm.allow_code;
+
+		if (rule_add(handle, subject_id, object_id, perm))
+			return -1;
+
+		/* Skip the line terminator */
+		++p;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads rules from a file that cannot be mapped, such as a pipe, in big
+ * chunks. Only an incomplete last line is moved back to the buffer start.
+ *
+ * With a session given, the rules read so far are written through it and
+ * dropped from the handle whenever they take more than max_memory. The
+ * labels are kept for the next batch and not counted.
+ */
+static int accesses_read(struct smack_accesses *handle, int fd,
+			 struct smack_session *session, size_t max_memory,
+			 int clear)
+{
+	size_t size = READ_CHUNK_SIZE;
+	size_t len = 0;
+	char *buf;
+	char *tmp;
+	char *line_end;
+	ssize_t ret;
 
-		if (subject == NULL || object == NULL || access == NULL ||
-		    strtok_r(NULL, " \t\n", &ptr) != NULL)
+	buf = malloc(size);
+	if (buf == NULL)
+		return -1;
+
+	for (;;) {
+		if (len == size) {
+			/* A single line does not fit, grow the buffer */
+			tmp = realloc(buf, size << 1);
+			if (tmp == NULL)
+				goto err_out;
+			buf = tmp;
+			size <<= 1;
+		}
+
+		ret = read(fd, buf + len, size - len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
 			goto err_out;
+		}
+		if (ret == 0)
+			break;
 
-		if (access2 == NULL)
-			ret = smack_accesses_add(accesses, subject, object, access);
-		else
-			ret = smack_accesses_add_modify(accesses, subject, object, access, access2);
+		len += ret;
+		/* Parse up to the last complete line */
+		for (line_end = buf + len; line_end > buf; --line_end)
+			if (line_end[-1] == '\n')
+				break;
+		if (line_end == buf)
+			continue;
 
-		if (ret)
+		if (accesses_parse(handle, buf, line_end))
 			goto err_out;
+
+		if (session != NULL &&
+		    size + accesses_rules_memory(handle) > max_memory) {
+			if (session_write(session, handle, NULL, clear))
+				goto err_out;
+			accesses_reset(handle);
+		}
+
+		len = buf + len - line_end;
+		memmove(buf, line_end, len);
 	}
 
-	if (ferror(file))
+	if (len > 0 && accesses_parse(handle, buf, buf + len))
 		goto err_out;
 
 	free(buf);
-	fclose(file);
 	return 0;
 err_out:
 	free(buf);
-	fclose(file);
 	return -1;
 }
 
-int smack_have_access(const char *subject, const char *object,
-		      const char *access_type)
-{
-	char buf[LOAD_LEN + 1];
-	char str[ACC_LEN + 1];
-	int code;
+struct parse_job {
+	struct smack_accesses *handle;
+	const char *buf;
+	const char *end;
 	int ret;
-	int fd;
-	int use_long = 1;
-	ssize_t slen;
-	ssize_t olen;
+};
 
-	if (init_smackfs_mnt())
-		return -1;
+static void *parse_job_run(void *arg)
+{
+	struct parse_job *job = arg;
 
-	slen = get_label(NULL, subject, NULL);
-	olen = get_label(NULL, object, NULL);
+	job->ret = accesses_parse(job->handle, job->buf, job->end);
+	return NULL;
+}
 
-	if (slen < 0 || olen < 0)
-		return -1;
+/*
+ * Splits buf at line boundaries and parses the parts concurrently into
+ * handles of their own, which are then merged into handle in file order.
+ * Labels get the same ids and rules the same order as if the whole
+ * buffer had been parsed at once.
+ */
+static int accesses_parse_parallel(struct smack_accesses *handle,
+				   const char *buf, const char *end)
+{
+	struct parse_job *jobs;
+	pthread_t *threads;
+	const char *split;
+	const char *p;
+	size_t chunk;
+	int cnt = handle->threads;
+	int started;
+	int ret = 0;
+	int i;
 
-	fd = open_smackfs_file("access2", "access", O_RDWR, &use_long);
-	if (fd < 0)
-		return -1;
+	if ((size_t) (end - buf) / PARSE_MIN_CHUNK < (size_t) cnt)
+		cnt = (end - buf) / PARSE_MIN_CHUNK;
+	if (cnt < 2)
+		return accesses_parse(handle, buf, end);
 
-	if (!use_long && (slen > SHORT_LABEL_LEN || olen > SHORT_LABEL_LEN))  {
-		close(fd);
-		return -1;
+	jobs = calloc(cnt, sizeof(struct parse_job));
+	threads = calloc(cnt, sizeof(pthread_t));
+	if (jobs == NULL || threads == NULL) {
+		ret = -1;
+		goto out;
 	}
 
-	if ((code = str_to_access_code(access_type)) < 0)
-		return -1;
-	access_code_to_str(code, str);
+	chunk = (end - buf) / cnt;
+	for (i = 0, p = buf; i < cnt; ++i) {
+		jobs[i].buf = p;
+		split = buf + (i + 1) * chunk;
+		if (i == cnt - 1) {
+			p = end;
+		} else if (p < split) {
+			p = memchr(split - 1, '\n', end - split + 1);
+			p = p ? p + 1 : end;
+		}
+		jobs[i].end = p;
+
+		if (smack_accesses_new(&jobs[i].handle)) {
+			ret = -1;
+			goto out;
+		}
+		jobs[i].handle->collapse = handle->collapse;
+	}
+
+	/* The first part is parsed on the calling thread */
+	for (started = 1; started < cnt; ++started)
+		if (pthread_create(&threads[started], NULL, parse_job_run,
+				   &jobs[started]))
+			break;
 
-	if (use_long)
-		ret = snprintf(buf, LOAD_LEN + 1, KERNEL_LONG_FORMAT,
-			       subject, object, str);
+	if (started == cnt)
+		parse_job_run(&jobs[0]);
 	else
-		ret = snprintf(buf, LOAD_LEN + 1, KERNEL_SHORT_FORMAT,
-			       subject, object, str);
+		ret = -1;
 
-	if (ret < 0 || ret >= LOAD_LEN + 1) {
-		close(fd);
-		return -1;
-	}
+	for (i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
 
-	ret = write(fd, buf, strlen(buf));
-	if (ret < 0) {
-		close(fd);
-		return -1;
-	}
+	/* A bad part anywhere leaves the handle as it was */
+	for (i = 0; i < cnt; ++i)
+		if (jobs[i].ret)
+			ret = -1;
 
-	ret = read(fd, buf, 1);
-	close(fd);
-	if (ret < 0)
-		return -1;
+	for (i = 0; i < cnt && ret == 0; ++i)
+		if (accesses_merge(handle, jobs[i].handle))
+			ret = -1;
 
-	return buf[0] == '1';
+out:
+	if (jobs != NULL)
+		for (i = 0; i < cnt; ++i)
+			smack_accesses_free(jobs[i].handle);
+	free(threads);
+	free(jobs);
+	return ret;
 }
 
-int smack_cipso_new(struct smack_cipso **cipso)
+int smack_accesses_set_threads(struct smack_accesses *handle, int threads)
 {
-	struct smack_cipso *result;
+	if (threads < 0)
+		return -1;
 
-	result = calloc(1, sizeof(struct smack_cipso));
-	if (result == NULL)
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+	}
+
+	handle->threads = threads;
+	return 0;
+}
+
+int smack_accesses_set_writer(struct smack_accesses *handle, int chunk_size,
+			      int pipelined)
+{
+	if (chunk_size < 0 || chunk_size > WRITE_CHUNK_MAX)
 		return -1;
 
-	*cipso = result;
+	handle->write_chunk = chunk_size ? chunk_size : handle->page_size;
+	handle->write_pipelined = pipelined != 0;
 	return 0;
 }
 
-void smack_cipso_free(struct smack_cipso *cipso)
+int smack_accesses_set_collapse(struct smack_accesses *handle, int collapse)
 {
-	if (cipso == NULL)
-		return;
+	handle->collapse = collapse != 0;
+	if (!handle->collapse) {
+		free(handle->folds);
+		handle->folds = NULL;
+		handle->folds_ready = 0;
+	}
+	return 0;
+}
 
-	struct cipso_mapping *mapping = cipso->first;
-	struct cipso_mapping *next_mapping = NULL;
+static int accesses_add_fd(struct smack_accesses *accesses, int fd)
+{
+	struct stat sb;
+	off_t offset;
+	char *map;
+	int ret;
 
-	while (mapping != NULL) {
-		next_mapping = mapping->next;
-		free(mapping);
-		mapping = next_mapping;
+	if (fstat(fd, &sb) == -1)
+		return -1;
+
+	/* Regular files are parsed in place, anything else is read */
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+	    (uint64_t) sb.st_size > SIZE_MAX)
+		return accesses_read(accesses, fd, NULL, 0, 0);
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == -1 || offset > sb.st_size)
+		return accesses_read(accesses, fd, NULL, 0, 0);
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return accesses_read(accesses, fd, NULL, 0, 0);
+
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+	if (accesses->threads > 1)
+		ret = accesses_parse_parallel(accesses, map + offset,
+					      map + sb.st_size);
+	else
+		ret = accesses_parse(accesses, map + offset, map + sb.st_size);
+	munmap(map, sb.st_size);
+
+	/* Leave the file offset where reading the file would */
+	if (lseek(fd, 0, SEEK_END) == -1)
+		return -1;
+
+	return ret;
+}
+
+int smack_accesses_add_from_file(struct smack_accesses *accesses, int fd)
+{
+	uint64_t start = clock_ns();
+	int ret;
+
+	SMACK_PROBE1(add_from_file_entry, fd);
+	ret = accesses_add_fd(accesses, fd);
+	accesses->stats.parse_ns += clock_ns() - start;
+	SMACK_PROBE2(add_from_file_return, ret,
+		     accesses->rules_cnt + accesses->new_rules_cnt);
+	return ret;
+}
+
+struct files_queue {
+	struct parse_job *jobs;
+	const int *fds;
+	int cnt;
+	int next;
+	int collapse;
+};
+
+static void *files_queue_run(void *arg)
+{
+	struct files_queue *queue = arg;
+	struct parse_job *job;
+	int i;
+
+	while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) <
+	       queue->cnt) {
+		job = &queue->jobs[i];
+		job->ret = smack_accesses_new(&job->handle);
+		if (job->ret == 0) {
+			job->handle->collapse = queue->collapse;
+			job->ret = accesses_add_fd(job->handle,
+						   queue->fds[i]);
+		}
 	}
 
-	free(cipso);
+	return NULL;
 }
 
-int smack_cipso_apply(struct smack_cipso *cipso)
+int smack_accesses_add_from_files(struct smack_accesses *handle,
+				  const int *fds, int cnt)
 {
-	struct cipso_mapping *m = NULL;
-	char buf[CIPSO_MAX_SIZE];
-	int fd;
+	struct files_queue queue = {.fds = fds, .cnt = cnt,
+				    .collapse = handle->collapse};
+	pthread_t *threads;
+	uint64_t start = clock_ns();
+	int workers = handle->threads < cnt ? handle->threads : cnt;
+	int started;
+	int ret = 0;
 	int i;
-	int offset;
-	int use_long;
+
+	if (workers < 2) {
+		for (i = 0; i < cnt && ret == 0; ++i)
+			ret = accesses_add_fd(handle, fds[i]);
+		handle->stats.parse_ns += clock_ns() - start;
+		return ret;
+	}
+
+	queue.jobs = calloc(cnt, sizeof(struct parse_job));
+	threads = calloc(workers, sizeof(pthread_t));
+	if (queue.jobs == NULL || threads == NULL) {
+		free(threads);
+		free(queue.jobs);
+		return -1;
+	}
+
+	/* Files are taken from a shared queue, the calling thread helps */
+	for (started = 1; started < workers; ++started)
+		if (pthread_create(&threads[started], NULL, files_queue_run,
+				   &queue))
+			break;
+	files_queue_run(&queue);
+	for (i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < cnt && ret == 0; ++i)
+		if (queue.jobs[i].ret ||
+		    accesses_merge(handle, queue.jobs[i].handle))
+			ret = -1;
+
+	for (i = 0; i < cnt; ++i)
+		smack_accesses_free(queue.jobs[i].handle);
+	free(threads);
+	free(queue.jobs);
+	handle->stats.parse_ns += clock_ns() - start;
+	return ret;
+}
+
+int smack_accesses_merge(struct smack_accesses *dst,
+			 struct smack_accesses *src)
+{
+	if (dst == src)
+		return -1;
+
+	return accesses_merge(dst, src);
+}
+
+int smack_accesses_get_stats(struct smack_accesses *handle,
+			     struct smack_accesses_stats *result)
+{
+	struct smack_accesses_stats s;
+	struct smack_accesses_stats *stats = &s;
+	uint64_t probes = 0;
+	uint32_t mask = handle->dict_size - 1;
+	uint32_t dist;
+	uint32_t i;
+	int merge_cnt;
+	int x;
+	int y;
+
+	if (result->size < sizeof(result->size) || accesses_finalize(handle))
+		return -1;
+
+	*stats = handle->stats;
+	stats->size = sizeof(struct smack_accesses_stats);
+	stats->labels = handle->labels_cnt;
+	stats->long_labels = 0;
+	for (x = 0; x < handle->labels_cnt; ++x)
+		if (handle->labels[x].len > SHORT_LABEL_LEN)
+			stats->long_labels++;
+
+	stats->rules = handle->rules_cnt;
+	/* Every pair with rules is written as one rule */
+	stats->merged_rules = 0;
+	bzero(handle->merge_perms, handle->labels_cnt * sizeof(union smack_perm));
+	for (x = 0; x < handle->labels_cnt; ++x) {
+		merge_cnt = subject_merge(handle, x, 0);
+		for (y = 0; y < merge_cnt; ++y)
+			handle->merge_perms[handle->merge_object_ids[y]].allow_deny_code = 0;
+		stats->merged_rules += merge_cnt;
+	}
+
+	stats->label_bytes = handle->label_pool_alloc +
+		(uint64_t) handle->labels_alloc * sizeof(struct smack_label) +
+		(uint64_t) handle->dict_size * sizeof(struct smack_dict_slot);
+	stats->rule_bytes = (uint64_t) handle->rules_cnt * sizeof(struct smack_rule) +
+		(uint64_t) (handle->rules_labels_cnt + 1) * sizeof(uint32_t);
+	if (handle->pairs != NULL)
+		stats->rule_bytes += ((uint64_t) handle->pairs_mask + 1) *
+			sizeof(struct smack_pair_slot);
+	if (handle->folds != NULL)
+		stats->rule_bytes += ((uint64_t) handle->folds_mask + 1) *
+			sizeof(struct smack_fold_slot);
+
+	stats->dict_size = handle->dict_size;
+	stats->dict_probe_max = 0;
+	for (i = 0; i < handle->dict_size; ++i) {
+		if (handle->dict[i].id < 0)
+			continue;
+		dist = ((i - dict_home(handle, handle->dict[i].hash)) & mask) + 1;
+		probes += dist;
+		if (dist > stats->dict_probe_max)
+			stats->dict_probe_max = dist;
+	}
+	stats->dict_probe_avg = handle->labels_cnt ?
+		(double) probes / handle->labels_cnt : 0;
+
+	/* A caller built against an older header gets the fields it knows */
+	if (stats->size > result->size)
+		stats->size = result->size;
+	memcpy(result, stats, stats->size);
+	return 0;
+}
+
+int smack_accesses_save_compiled(struct smack_accesses *handle, int fd)
+{
+	struct smack_compiled_header *header;
+	struct smack_compiled_label *records;
+	struct smack_rule *rules;
+	uint32_t *rules_start;
+	struct smack_label *label;
+	char *strings;
+	char *image;
+	uint64_t size;
+	uint32_t hash;
+	uint32_t i;
+	ssize_t ret;
+	int x;
+
+	if (accesses_finalize(handle))
+		return -1;
+
+	size = sizeof(struct smack_compiled_header) +
+	       (uint64_t) handle->labels_cnt * sizeof(struct smack_compiled_label) +
+	       (handle->labels_cnt + 1ULL) * sizeof(uint32_t) +
+	       (uint64_t) handle->rules_cnt * sizeof(struct smack_rule) +
+	       handle->label_pool_size;
+	if (size > SIZE_MAX)
+		return -1;
+
+	/* Zeroed, so that padding in the rules is deterministic */
+	image = calloc(1, size);
+	if (image == NULL)
+		return -1;
+
+	header = (struct smack_compiled_header *) image;
+	records = (struct smack_compiled_label *) (header + 1);
+	rules_start = (uint32_t *) (records + handle->labels_cnt);
+	rules = (struct smack_rule *) (rules_start + handle->labels_cnt + 1);
+	strings = (char *) (rules + handle->rules_cnt);
+
+	memcpy(header->magic, COMPILED_MAGIC, sizeof(header->magic));
+	header->version = COMPILED_VERSION;
+	header->byte_order = COMPILED_BYTE_ORDER;
+	header->labels_cnt = handle->labels_cnt;
+	header->rules_cnt = handle->rules_cnt;
+	header->strings_size = handle->label_pool_size;
+	header->has_long = handle->has_long;
+
+	/* The pool is the string table of the image as it is */
+	for (x = 0; x < handle->labels_cnt; ++x) {
+		label = &handle->labels[x];
+		label_span(handle->label_pool + label->offset,
+			   handle->label_pool + label->offset + label->len,
+			   &hash);
+		records[x].offset = label->offset;
+		records[x].hash = hash;
+		records[x].len = label->len;
+	}
+	memcpy(strings, handle->label_pool, handle->label_pool_size);
+
+	memcpy(rules_start, handle->rules_start,
+	       (handle->labels_cnt + 1) * sizeof(uint32_t));
+	for (i = 0; i < handle->rules_cnt; ++i) {
+		rules[i].object_id = handle->rules[i].object_id;
+		rules[i].perm = handle->rules[i].perm;
+	}
+
+	header->crc = crc32_update(0, header + 1, size - sizeof(*header));
+
+	for (i = 0; i < size; ) {
+		ret = write(fd, image + i, size - i);
+		if (ret == -1) {
+			if (errno != EINTR)
+				break;
+		} else
+			i += ret;
+	}
+
+	free(image);
+	return i == size ? 0 : -1;
+}
+
+int smack_accesses_load_compiled(struct smack_accesses *handle, int fd)
+{
+	struct smack_accesses *image_handle;
+	struct stat sb;
+	char *image = NULL;
+	char *buf;
+	size_t alloc = 0;
+	size_t size = 0;
+	ssize_t len;
+	int mapped = 0;
 	int ret;
-	int buf_len = sizeof(buf);
+
+	if (fstat(fd, &sb) == -1)
+		return -1;
+
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+	    (uint64_t) sb.st_size <= SIZE_MAX &&
+	    lseek(fd, 0, SEEK_CUR) == 0) {
+		image = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED)
+			image = NULL;
+		else {
+			mapped = 1;
+			size = sb.st_size;
+		}
+	}
+
+	/* Pipes and the like are read completely into memory */
+	while (!mapped) {
+		if (size == alloc) {
+			alloc = alloc ? alloc << 1 : READ_CHUNK_SIZE;
+			buf = realloc(image, alloc);
+			if (buf == NULL) {
+				free(image);
+				return -1;
+			}
+			image = buf;
+		}
+
+		len = read(fd, image + size, alloc - size);
+		if (len == 0)
+			break;
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			free(image);
+			return -1;
+		}
+		size += len;
+	}
+
+	if (handle->labels_cnt == 0 && handle->new_rules_cnt == 0) {
+		ret = accesses_load_image(handle, image, size);
+	} else {
+		ret = smack_accesses_new(&image_handle);
+		if (ret == 0) {
+			ret = accesses_load_image(image_handle, image, size);
+			if (ret == 0)
+				ret = accesses_merge(handle, image_handle);
+			smack_accesses_free(image_handle);
+		}
+	}
+
+	if (mapped) {
+		munmap(image, size);
+		if (lseek(fd, 0, SEEK_END) == -1)
+			return -1;
+	} else
+		free(image);
+
+	return ret;
+}
+
+int smack_accesses_new_from_kernel(struct smack_accesses **accesses)
+{
+	struct smack_accesses *result;
+	int use_long = 1;
+	int fd;
 
 	if (init_smackfs_mnt())
 		return -1;
 
-	fd = open_smackfs_file("cipso2", "cipso", O_WRONLY, &use_long);
+	fd = open_smackfs_file("load2", "load", O_RDONLY, &use_long);
 	if (fd < 0)
 		return -1;
 
-	if (!use_long && cipso->has_long)
-		goto err_out;
+	if (smack_accesses_new(&result)) {
+		close(fd);
+		return -1;
+	}
 
-	for (m = cipso->first; m != NULL; m = m->next) {
-		if (use_long) {
-			ret = snprintf(buf, SMACK_LABEL_LEN + 1, "%s", m->label);
-			if (ret < 0 || ret > SMACK_LABEL_LEN)
-				goto err_out;
-		} else {
-			ret = snprintf(buf, SHORT_LABEL_LEN + 1, "%-23s", m->label);
-			if (ret < 0 || ret > SHORT_LABEL_LEN)
-				goto err_out;
-		}
+	if (accesses_read(result, fd, NULL, 0, 0)) {
+		smack_accesses_free(result);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	*accesses = result;
+	return 0;
+}
+
+static inline int label_is(const char *label, int len, char c)
+{
+	return len == 1 && label[0] == c;
+}
+
+static inline int pair_lookup(struct smack_accesses *handle,
+			      uint32_t subject_id, uint32_t object_id)
+{
+	struct smack_pair_slot *slot;
+	uint64_t key = (uint64_t) subject_id << 32 | object_id;
+	uint32_t pos = (key * PAIRS_GOLDEN) >> 32 & handle->pairs_mask;
+
+	for (;; pos = (pos + 1) & handle->pairs_mask) {
+		slot = &handle->pairs[pos];
+		if (slot->subject_id == PAIR_EMPTY)
+			return -1;
+		if (slot->subject_id == subject_id &&
+		    slot->object_id == object_id)
+			return slot->allow_code;
+	}
+}
+
+/*
+ * Decides the requests that the kernel answers without looking at the
+ * rules, checked in the order the kernel does. Returns 1 or 0, or -1 if
+ * the rules decide.
+ */
+static int builtin_access(const char *subject, int slen,
+			  const char *object, int olen, int request)
+{
+	if (label_is(subject, slen, '*'))
+		return 0;
+	if (label_is(subject, slen, '@') || label_is(object, olen, '@') ||
+	    label_is(object, olen, '*'))
+		return 1;
+	if (slen == olen && memcmp(subject, object, slen) == 0)
+		return 1;
+	if ((request & (ACCESS_TYPE_R | ACCESS_TYPE_X)) == request ||
+	    (request & ACCESS_TYPE_L) == request)
+		if (label_is(object, olen, '_') || label_is(subject, slen, '^'))
+			return 1;
+
+	return -1;
+}
+
+int smack_accesses_check(struct smack_accesses *handle, const char *subject,
+			 const char *object, const char *access_type)
+{
+	uint32_t subject_hash = 0;
+	uint32_t object_hash = 0;
+	ssize_t slen;
+	ssize_t olen;
+	int subject_id;
+	int object_id;
+	int request;
+	int allow;
+
+	slen = get_label(NULL, subject, &subject_hash);
+	olen = get_label(NULL, object, &object_hash);
+	request = str_to_access_code(access_type);
+	if (slen < 0 || olen < 0 || request < 0)
+		return -1;
+
+	allow = builtin_access(subject, slen, object, olen, request);
+	if (allow >= 0)
+		return allow;
+
+	if (!__atomic_load_n(&handle->pairs_ready, __ATOMIC_ACQUIRE) ||
+	    handle->new_rules_cnt > 0) {
+		pthread_mutex_lock(&handle->pairs_lock);
+		allow = handle->pairs_ready && handle->new_rules_cnt == 0 ?
+			0 : pairs_build(handle);
+		pthread_mutex_unlock(&handle->pairs_lock);
+		if (allow)
+			return -1;
+	}
+
+	subject_id = is_label_known(handle, subject, slen, subject_hash);
+	object_id = is_label_known(handle, object, olen, object_hash);
+	if (subject_id < 0 || object_id < 0)
+		return 0;
+
+	/* Like the kernel, a rule without any access allows nothing */
+	allow = pair_lookup(handle, subject_id, object_id);
+	if (allow <= 0)
+		return 0;
+
+	return (request & allow) == request;
+}
+
+int smack_have_access(const char *subject, const char *object,
+		      const char *access_type)
+{
+	struct smack_access_query query = {
+		.subject = subject,
+		.object = object,
+		.access_type = access_type,
+	};
+
+	SMACK_PROBE3(have_access_entry, subject, object, access_type);
+	if (smack_have_access_batch(&query, 1))
+		query.result = -1;
+	SMACK_PROBE1(have_access_return, query.result);
+
+	return query.result;
+}
+
+static pthread_key_t access_state_key;
+static pthread_once_t access_state_once = PTHREAD_ONCE_INIT;
+
+static struct smack_access_cache *access_cache;
+static uint64_t access_cache_hits;
+static uint64_t access_cache_misses;
+static uint64_t access_cache_builtin;
+
+static uint64_t *generation;
+static int generation_writable;
+static int generation_write_failed;
+/* Counter of a backend standing in for smackfs, whose policy no other
+ * process sees */
+static uint64_t generation_local;
+static pthread_mutex_t generation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Maps the shared policy generation counter, writable if the process may
+ * create or change it and read-only otherwise. Returns NULL if the counter
+ * cannot be mapped or a writable mapping is needed but not possible. A
+ * failed writable mapping is not tried again.
+ */
+static uint64_t *generation_map(int write)
+{
+	struct stat sb;
+	uint64_t *map;
+	int writable = 1;
+	int mapped;
+	int fd = -1;
+
+	init_smackfs_mnt();
+
+	pthread_mutex_lock(&generation_lock);
+	if (smackfs_emulated || smackfs_directory) {
+		__atomic_store_n(&generation, &generation_local,
+				 __ATOMIC_RELEASE);
+		generation_writable = 1;
+		goto out;
+	}
+	mapped = generation != NULL && generation != &generation_local;
+	if (mapped && (generation_writable || !write))
+		goto out;
+	if (generation_write_failed) {
+		if (write || mapped)
+			goto out;
+		writable = 0;
+	}
+
+	if (writable) {
+		mkdir(GENERATION_DIR, 0755);
+		fd = open(GENERATION_PATH, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			writable = 0;
+	}
+	if (!writable) {
+		generation_write_failed = 1;
+		fd = open(GENERATION_PATH, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0)
+		goto out;
+
+	if (fstat(fd, &sb) == -1 ||
+	    (sb.st_size < (off_t) sizeof(uint64_t) &&
+	     (!writable || ftruncate(fd, sizeof(uint64_t)) == -1))) {
+		generation_write_failed |= writable;
+		close(fd);
+		goto out;
+	}
+
+	map = mmap(NULL, sizeof(uint64_t),
+		   writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		generation_write_failed |= writable;
+		goto out;
+	}
+
+	/* An older read-only mapping is left in place, readers may still
+	 * be using it */
+	__atomic_store_n(&generation, map, __ATOMIC_RELEASE);
+	generation_writable = writable;
+out:
+	map = generation;
+	if (map == &generation_local && !(smackfs_emulated || smackfs_directory))
+		map = NULL;
+	if (write && !generation_writable)
+		map = NULL;
+	pthread_mutex_unlock(&generation_lock);
+	return map;
+}
+
+/* Invalidates the cached access decisions of every process */
+static void generation_bump(void)
+{
+	uint64_t *map = generation_map(1);
+
+	if (map != NULL)
+		__atomic_add_fetch(map, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t cache_hash(uint32_t subject_hash, uint32_t object_hash,
+				  int request)
+{
+	return (subject_hash * 31 + object_hash) * DICT_GOLDEN ^ request;
+}
+
+static int cache_lookup(struct smack_cache_slot *slot, uint32_t hash,
+			uint32_t gen, const char *subject, int slen,
+			const char *object, int olen, int request)
+{
+	uint32_t seq;
+	int match;
+	int result;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -1;
+
+	match = slot->hash == hash && slot->generation == gen &&
+		slot->subject_len == slen && slot->object_len == olen &&
+		slot->request == request &&
+		memcmp(slot->key, subject, slen) == 0 &&
+		memcmp(slot->key + slen, object, olen) == 0;
+	result = slot->result;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (!match || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+		return -1;
+
+	return result;
+}
+
+static void cache_store(struct smack_cache_slot *slot, uint32_t hash,
+			uint32_t gen, const char *subject, int slen,
+			const char *object, int olen, int request, int result)
+{
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	/* Leave the slot to a writer that is already at it */
+	if ((seq & 1) ||
+	    !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	slot->generation = gen;
+	slot->hash = hash;
+	slot->subject_len = slen;
+	slot->object_len = olen;
+	slot->request = request;
+	slot->result = result;
+	memcpy(slot->key, subject, slen);
+	memcpy(slot->key + slen, object, olen);
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void access_state_free(void *arg)
+{
+	struct smack_access_state *state = arg;
+
+	if (state->fd >= 0)
+		close(state->fd);
+	free(state);
+}
+
+/* The child must not share the open file, and so a pending answer, with
+ * the parent */
+static void access_state_atfork_child(void)
+{
+	struct smack_access_state *state;
+
+	state = pthread_getspecific(access_state_key);
+	if (state != NULL && state->fd >= 0) {
+		close(state->fd);
+		state->fd = -1;
+	}
+}
+
+static void access_state_init(void)
+{
+	pthread_key_create(&access_state_key, access_state_free);
+	pthread_atfork(NULL, NULL, access_state_atfork_child);
+}
+
+static struct smack_access_state *access_state_get(void)
+{
+	struct smack_access_state *state;
+
+	if (pthread_once(&access_state_once, access_state_init))
+		return NULL;
+
+	state = pthread_getspecific(access_state_key);
+	if (state != NULL)
+		return state;
+
+	state = calloc(1, sizeof(struct smack_access_state));
+	if (state == NULL)
+		return NULL;
+	state->fd = -1;
+	state->reuse = 1;
+
+	if (pthread_setspecific(access_state_key, state)) {
+		free(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+static int access_state_open(struct smack_access_state *state)
+{
+	if (state->probed)
+		state->fd = smackfs_open(state->use_long ? "access2" : "access",
+					 O_RDWR | O_CLOEXEC);
+	else
+		state->fd = open_smackfs_file("access2", "access",
+					      O_RDWR | O_CLOEXEC,
+					      &state->use_long);
+	if (state->fd < 0)
+		return -1;
+
+	state->probed = 1;
+	state->used = 0;
+	return 0;
+}
+
+/*
+ * Asks the kernel about one query. Returns -1 if the kernel interface
+ * cannot be opened, a failure of the query itself is left in its result.
+ */
+static int access_query(struct smack_access_state *state,
+			struct smack_access_query *query)
+{
+	struct smack_access_cache *cache;
+	struct smack_cache_slot *slot = NULL;
+	char *buf = state->buf;
+	uint32_t subject_hash = 0;
+	uint32_t object_hash = 0;
+	uint32_t hash = 0;
+	uint32_t gen = 0;
+	ssize_t slen;
+	ssize_t olen;
+	int code;
+	int len;
+	int ret;
+
+	query->result = -1;
+
+	slen = get_label(NULL, query->subject, &subject_hash);
+	olen = get_label(NULL, query->object, &object_hash);
+	code = query->access_type ? str_to_access_code(query->access_type) : -1;
+	if (slen < 0 || olen < 0 || code < 0)
+		return 0;
+
+	cache = __atomic_load_n(&access_cache, __ATOMIC_ACQUIRE);
+	if (cache != NULL) {
+		ret = builtin_access(query->subject, slen, query->object, olen,
+				     code);
+		if (ret >= 0) {
+			__atomic_add_fetch(&access_cache_builtin, 1,
+					   __ATOMIC_RELAXED);
+			query->result = ret;
+			return 0;
+		}
+
+		/* Long labels are not cached */
+		if (slen + olen <= CACHE_KEY_LEN) {
+			hash = cache_hash(subject_hash, object_hash, code);
+			slot = &cache->slots[hash & cache->mask];
+			gen = __atomic_load_n(generation, __ATOMIC_ACQUIRE);
+			ret = cache_lookup(slot, hash, gen, query->subject,
+					   slen, query->object, olen, code);
+			if (ret >= 0) {
+				__atomic_add_fetch(&access_cache_hits, 1,
+						   __ATOMIC_RELAXED);
+				query->result = ret;
+				return 0;
+			}
+			__atomic_add_fetch(&access_cache_misses, 1,
+					   __ATOMIC_RELAXED);
+		}
+	}
+
+	if (state->fd < 0 && access_state_open(state))
+		return -1;
+
+	if (!state->use_long && (slen > SHORT_LABEL_LEN || olen > SHORT_LABEL_LEN))
+		return 0;
+
+	if (state->use_long) {
+		memcpy(buf, query->subject, slen);
+		buf[slen] = ' ';
+		memcpy(buf + slen + 1, query->object, olen);
+		buf[slen + 1 + olen] = ' ';
+		memcpy(buf + slen + 1 + olen + 1, access_strs[code], ACC_LEN);
+		len = slen + 1 + olen + 1 + ACC_LEN;
+	} else {
+		len = short_rule_render(buf, query->subject, slen,
+					query->object, olen, access_strs[code]);
+	}
+
+	ret = smackfs_write(state->fd, buf, len);
+	if (ret < 0 && errno == EBUSY && state->used) {
+		/* The kernel takes only one query per open file, open it
+		 * for every query of this thread from now on */
+		state->reuse = 0;
+		close(state->fd);
+		if (access_state_open(state))
+			return -1;
+		ret = smackfs_write(state->fd, buf, len);
+	}
+
+	/* The answer is always at the start, however often the file has
+	 * been written */
+	if (ret >= 0)
+		ret = pread(state->fd, buf, 1, 0);
+	if (ret > 0) {
+		query->result = buf[0] == '1';
+		/* Tagged with the generation from before the question, a
+		 * change of policy meanwhile makes the entry stale */
+		if (slot != NULL)
+			cache_store(slot, hash, gen, query->subject, slen,
+				    query->object, olen, code, query->result);
+	}
+
+	state->used = 1;
+	if (ret <= 0 || !state->reuse) {
+		close(state->fd);
+		state->fd = -1;
+	}
+
+	return 0;
+}
+
+int smack_have_access_batch(struct smack_access_query *queries, int cnt)
+{
+	struct smack_access_state *state;
+	int i;
+
+	if (init_smackfs_mnt())
+		return -1;
+
+	state = access_state_get();
+	if (state == NULL)
+		return -1;
+
+	for (i = 0; i < cnt; ++i)
+		if (access_query(state, &queries[i]))
+			return -1;
+
+	return 0;
+}
+
+int smack_access_cache_enable(int entries)
+{
+	struct smack_access_cache *cache;
+	struct smack_access_cache *installed = NULL;
+	uint32_t size = 1;
+
+	if (entries < 0 || entries > CACHE_MAX_ENTRIES)
+		return -1;
+
+	if (entries == 0) {
+		cache = __atomic_exchange_n(&access_cache, NULL,
+					    __ATOMIC_ACQ_REL);
+		free(cache);
+		return 0;
+	}
+
+	/* A table in use is never replaced, resizing takes disabling the
+	 * cache first */
+	if (__atomic_load_n(&access_cache, __ATOMIC_ACQUIRE) != NULL ||
+	    generation_map(0) == NULL)
+		return -1;
+
+	while (size < (uint32_t) entries)
+		size <<= 1;
+	cache = calloc(1, sizeof(struct smack_access_cache) +
+		       size * sizeof(struct smack_cache_slot));
+	if (cache == NULL)
+		return -1;
+	cache->mask = size - 1;
+
+	if (!__atomic_compare_exchange_n(&access_cache, &installed, cache, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(cache);
+		return -1;
+	}
+	return 0;
+}
+
+void smack_access_cache_get_stats(struct smack_access_cache_stats *stats)
+{
+	stats->hits = __atomic_load_n(&access_cache_hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&access_cache_misses, __ATOMIC_RELAXED);
+	stats->builtin = __atomic_load_n(&access_cache_builtin, __ATOMIC_RELAXED);
+}
+
+void smack_have_access_release(void)
+{
+	struct smack_access_state *state;
+
+	if (pthread_once(&access_state_once, access_state_init))
+		return;
+
+	state = pthread_getspecific(access_state_key);
+	if (state == NULL)
+		return;
+
+	pthread_setspecific(access_state_key, NULL);
+	access_state_free(state);
+}
+
+int smack_cipso_new(struct smack_cipso **cipso)
+{
+	struct smack_cipso *result;
+
+	result = calloc(1, sizeof(struct smack_cipso));
+	if (result == NULL)
+		return -1;
+
+	*cipso = result;
+	return 0;
+}
+
+void smack_cipso_free(struct smack_cipso *cipso)
+{
+	if (cipso == NULL)
+		return;
+
+	struct cipso_mapping *mapping = cipso->first;
+	struct cipso_mapping *next_mapping = NULL;
+
+	while (mapping != NULL) {
+		next_mapping = mapping->next;
+		free(mapping);
+		mapping = next_mapping;
+	}
+
+	free(cipso);
+}
+
+int smack_cipso_apply(struct smack_cipso *cipso)
+{
+	struct cipso_mapping *m = NULL;
+	char buf[CIPSO_MAX_SIZE];
+	int fd;
+	int i;
+	int offset;
+	int use_long;
+	int ret;
+	int buf_len = sizeof(buf);
+
+	if (init_smackfs_mnt())
+		return -1;
+
+	fd = open_smackfs_file("cipso2", "cipso", O_WRONLY, &use_long);
+	if (fd < 0)
+		return -1;
+
+	if (!use_long && cipso->has_long)
+		goto err_out;
+
+	for (m = cipso->first; m != NULL; m = m->next) {
+		if (use_long) {
+			ret = snprintf(buf, SMACK_LABEL_LEN + 1, "%s", m->label);
+			if (ret < 0 || ret > SMACK_LABEL_LEN)
+				goto err_out;
+		} else {
+			ret = snprintf(buf, SHORT_LABEL_LEN + 1, "%-23s", m->label);
+			if (ret < 0 || ret > SHORT_LABEL_LEN)
+				goto err_out;
+		}
+
+		offset = ret;
+		buf[offset++] = ' ';
+
+		ret = snprintf(buf + offset, buf_len - offset, CIPSO_NUM_LEN_STR, m->level);
+		if (ret < 0 || offset + ret >= buf_len)
+			goto err_out;
+		offset += ret;
+
+		ret = snprintf(buf + offset, buf_len - offset, CIPSO_NUM_LEN_STR, m->ncats);
+		if (ret < 0 || offset + ret >= buf_len)
+			goto err_out;
+		offset += ret;
+
+		for (i = 0; i < CAT_MAX_COUNT; i++) {
+			if (BITTEST(m->cats, i)) {
+				ret = snprintf(buf + offset, buf_len - offset,
+					CIPSO_NUM_LEN_STR, i + 1);
+				if (ret < 0 || offset + ret >= buf_len)
+					goto err_out;
+				offset += ret;
+			}
+		}
+
+		if (smackfs_write(fd, buf, offset) < 0)
+			goto err_out;
+	}
+
+	close(fd);
+	return 0;
+
+err_out:
+	close(fd);
+	return -1;
+}
+
+int smack_cipso_add_from_file(struct smack_cipso *cipso, int fd)
+{
+	struct cipso_mapping *mapping = NULL;
+	FILE *file = NULL;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	char *label, *level, *cat, *ptr;
+	long int val;
+	int i;
+	int newfd;
+
+	newfd = dup(fd);
+	if (newfd == -1)
+		return -1;
+
+	file = fdopen(newfd, "r");
+	if (file == NULL) {
+		close(newfd);
+		return -1;
+	}
+
+	while (getline(&buf, &buf_size, file) >= 0) {
+		mapping = calloc(1, sizeof(struct cipso_mapping));
+		if (mapping == NULL)
+			goto err_out;
+
+		label = strtok_r(buf, " \t\n", &ptr);
+		level = strtok_r(NULL, " \t\n", &ptr);
+		cat = strtok_r(NULL, " \t\n", &ptr);
+
+		if (level == NULL)
+			goto err_out;
+
+		val  = get_label(mapping->label, label, NULL);
+		if (val < 0)
+			goto err_out;
+		if (val > SHORT_LABEL_LEN)
+			cipso->has_long = 1;
+
+		errno = 0;
+		val = strtol(level, NULL, 10);
+		if (errno)
+			goto err_out;
+
+		if (val < 0 || val > LEVEL_MAX)
+			goto err_out;
+
+		mapping->level = val;
+
+		for (i = 0; i < CAT_MAX_COUNT && cat != NULL; i++) {
+			errno = 0;
+			val = strtol(cat, NULL, 10);
+			if (errno)
+				goto err_out;
+
+			if (val <= 0 || val > CAT_MAX_COUNT)
+				goto err_out;
+
+			if (!BITTEST(mapping->cats, val - 1)) {
+				BITSET(mapping->cats, val - 1);
+				++(mapping->ncats);
+			}
+
+			cat = strtok_r(NULL, " \t\n", &ptr);
+		}
+
+		if (cipso->first == NULL) {
+			cipso->first = cipso->last = mapping;
+		} else {
+			cipso->last->next = mapping;
+			cipso->last = mapping;
+		}
+	}
+
+	if (ferror(file))
+		goto err_out;
+
+	fclose(file);
+	free(buf);
+	return 0;
+err_out:
+	fclose(file);
+	free(mapping);
+	free(buf);
+	return -1;
+}
+
+const char *smack_smackfs_path(void)
+{
+	if (init_smackfs_mnt())
+		return NULL;
+	return smackfs_mnt;
+}
+
+static ssize_t smack_new_label_from_proc(const char *proc_path, char **label)
+{
+	char buf[SMACK_LABEL_LEN + 1];
+	char *result;
+	int fd;
+	int ret;
+
+	fd = open(proc_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = read(fd, buf, SMACK_LABEL_LEN);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	buf[ret] = '\0';
+
+	result = calloc(1, ret + 1);
+	if (result == NULL)
+		return -1;
+
+	ret = get_label(result, buf, NULL);
+	if (ret < 0) {
+		free(result);
+		return -1;
+	}
+
+	*label = result;
+	return ret;
+}
+
+ssize_t smack_new_label_from_self(char **label)
+{
+	ssize_t ret = smack_new_label_from_proc(SELF_LABEL_FILE, label);
+	if (ret < 0 && errno == ENOENT)
+		ret = smack_new_label_from_proc(OLD_SELF_LABEL_FILE, label);
+	return ret;
+}
+
+ssize_t smack_new_label_from_process(pid_t pid, char **label)
+{
+	char path[sizeof(PID_LABEL_FILE) + 20];
+	int ret;
+	ssize_t retval;
+
+	ret = snprintf(path, sizeof(path), PID_LABEL_FILE, pid);
+	if (ret < 0 || ret >= (int) sizeof(path))
+		return -1;
+	retval = smack_new_label_from_proc(path, label);
+	if (retval < 0 && errno == ENOENT) {
+		ret = snprintf(path, sizeof(path), OLD_PID_LABEL_FILE, pid);
+		if (ret < 0 || ret >= (int) sizeof(path))
+			return -1;
+		retval = smack_new_label_from_proc(path, label);
+	}
+	return retval;
+}
+
+ssize_t smack_new_label_from_socket(int fd, char **label)
+{
+	char buf[SMACK_LABEL_LEN + 2];
+	int ret;
+	socklen_t length = SMACK_LABEL_LEN + 1;
+	char *result;
+
+	/* If getsockopt return more then SMACK_LABEL_LEN the
+	 * buf does not contain proper smack label and get_label
+	 * will return error. */
+	ret = getsockopt(fd, SOL_SOCKET, SO_PEERSEC, buf, &length);
+	if (ret < 0)
+		return -1;
+
+	buf[length] = '\0';
+
+	result = calloc(1, length + 1);
+	if (result == NULL)
+		return -1;
+
+	ret = get_label(result, buf, NULL);
+	if (ret < 0) {
+		free(result);
+		return -1;
+	}
+
+	*label = result;
+	return ret;
+}
+
+/*
+ * Validates the label read into buf with the given length (or a failed
+ * read) and returns a copy of it in label.
+ */
+static ssize_t label_from_xattr(char *buf, ssize_t ret, char **label)
+{
+	char *result;
+
+	if (ret < 0)
+		return -1;
+	buf[ret] = '\0';
+
+	result = calloc(1, ret + 1);
+	if (result == NULL)
+		return -1;
+
+	ret = get_label(result, buf, NULL);
+	if (ret < 0) {
+		free(result);
+		return -1;
+	}
+
+	*label = result;
+	return ret;
+}
+
+ssize_t smack_new_label_from_path(const char *path, const char *xattr, 
+				  int follow, char **label)
+{
+	char buf[SMACK_LABEL_LEN + 1];
+	ssize_t ret = 0;
+
+	SMACK_PROBE1(label_get_entry, xattr);
+	ret = follow ?
+		getxattr(path, xattr, buf, SMACK_LABEL_LEN + 1) :
+		lgetxattr(path, xattr, buf, SMACK_LABEL_LEN + 1);
+	ret = label_from_xattr(buf, ret, label);
+	SMACK_PROBE1(label_get_return, ret);
+
+	return ret;
+}
+
+ssize_t smack_new_label_from_file(int fd, const char *xattr, 
+				  char **label)
+{
+	char buf[SMACK_LABEL_LEN + 1];
+	ssize_t ret = 0;
+
+	SMACK_PROBE1(label_get_entry, xattr);
+	ret = fgetxattr(fd, xattr, buf, SMACK_LABEL_LEN + 1);
+	ret = label_from_xattr(buf, ret, label);
+	SMACK_PROBE1(label_get_return, ret);
+
+	return ret;
+}
+
+int smack_set_label_for_path(const char *path,
+				  const char *xattr,
+				  int follow,
+				  const char *label)
+{
+	int len;
+	int ret;
+
+	len = (int)smack_label_length(label);
+	if (len < 0)
+		return -2;
+
+	SMACK_PROBE2(label_set_entry, xattr, len);
+	ret = follow ?
+		setxattr(path, xattr, label, len, 0) :
+		lsetxattr(path, xattr, label, len, 0);
+	SMACK_PROBE1(label_set_return, ret);
+
+	return ret;
+}
+
+int smack_set_label_for_file(int fd,
+				  const char *xattr,
+				  const char *label)
+{
+	int len;
+	int ret;
+
+	len = (int)smack_label_length(label);
+	if (len < 0)
+		return -2;
+
+	SMACK_PROBE2(label_set_entry, xattr, len);
+	ret = fsetxattr(fd, xattr, label, len, 0);
+	SMACK_PROBE1(label_set_return, ret);
+
+	return ret;
+}
+
+int smack_remove_label_for_path(const char *path,
+				  const char *xattr,
+				  int follow)
+{
+	return follow ? removexattr(path, xattr) : lremovexattr(path, xattr);
+}
+
+int smack_remove_label_for_file(int fd, const char *xattr)
+{
+	return fremovexattr(fd, xattr);
+}
+
+int smack_set_label_for_self(const char *label)
+{
+	int len;
+	int fd;
+	int ret;
+
+	len = get_label(NULL, label, NULL);
+	if (len < 0)
+		return -1;
+
+	fd = open(SELF_LABEL_FILE, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = write(fd, label, len);
+	close(fd);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+int smack_revoke_subject(const char *subject)
+{
+	int ret;
+	int fd;
+	int len;
+
+	if (init_smackfs_mnt())
+		return -1;
+
+	len = get_label(NULL, subject, NULL);
+	if (len < 0)
+		return -1;
+
+	fd = smackfs_open("revoke-subject", O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	ret = smackfs_write(fd, subject, len);
+	close(fd);
+	generation_bump();
+
+	return (ret < 0) ? -1 : 0;
+}
+
+ssize_t smack_label_length(const char *label)
+{
+	return get_label(NULL, label, NULL);
+}
+
+int smack_label_length_batch(const char **labels, int cnt, ssize_t *lengths)
+{
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < cnt; ++i) {
+		lengths[i] = get_label(NULL, labels[i], NULL);
+		if (lengths[i] < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Files of the emulated smackfs */
+#define EMUL_NONE 0
+#define EMUL_LOAD 1
+#define EMUL_CHANGE 2
+#define EMUL_ACCESS 3
+#define EMUL_CIPSO 4
+#define EMUL_REVOKE 5
+#define EMUL_OTHER 6
+
+static const struct {
+	const char *name;
+	int kind;
+} emul_names[] = {
+	{"load2", EMUL_LOAD},
+	{"change-rule", EMUL_CHANGE},
+	{"access2", EMUL_ACCESS},
+	{"cipso2", EMUL_CIPSO},
+	{"revoke-subject", EMUL_REVOKE},
+	{"onlycap", EMUL_OTHER},
+	{"relabel-self", EMUL_OTHER},
+};
+
+/* Open file of the emulation, found by the descriptor and checked by the
+ * inode of the temporary file behind it */
+struct emul_file {
+	dev_t dev;
+	ino_t ino;
+	int kind;
+};
+
+/*
+ * In-process stand-in for smackfs, used with the "emulated" backend. The
+ * labels are interned in a handle and the policy is kept as the access of
+ * every (subject, object) pair, like the kernel keeps it.
+ */
+static pthread_mutex_t emul_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct smack_accesses *emul_labels;
+static struct smack_pair_slot *emul_pairs;
+static uint32_t emul_pairs_mask;
+static uint32_t emul_pairs_cnt;
+static struct emul_file *emul_files;
+static int emul_files_cnt;
+
+static int emul_pairs_resize(void)
+{
+	struct smack_pair_slot *pairs;
+	uint32_t size = PAIRS_MIN_SIZE;
+	uint64_t key;
+	uint32_t pos;
+	uint32_t i;
+
+	if (emul_pairs != NULL) {
+		if (emul_pairs_mask == UINT32_MAX >> 1)
+			return -1;
+		size = (emul_pairs_mask + 1) << 1;
+	}
+
+	pairs = malloc(size * sizeof(struct smack_pair_slot));
+	if (pairs == NULL)
+		return -1;
+	for (pos = 0; pos < size; ++pos)
+		pairs[pos].subject_id = PAIR_EMPTY;
+
+	for (i = 0; emul_pairs != NULL && i <= emul_pairs_mask; ++i) {
+		if (emul_pairs[i].subject_id == PAIR_EMPTY)
+			continue;
+		key = (uint64_t) emul_pairs[i].subject_id << 32 |
+			emul_pairs[i].object_id;
+		pos = (key * PAIRS_GOLDEN) >> 32 & (size - 1);
+		while (pairs[pos].subject_id != PAIR_EMPTY)
+			pos = (pos + 1) & (size - 1);
+		pairs[pos] = emul_pairs[i];
+	}
+
+	free(emul_pairs);
+	emul_pairs = pairs;
+	emul_pairs_mask = size - 1;
+	return 0;
+}
+
+/* Returns the slot of the pair, a new one with no access if add is set */
+static struct smack_pair_slot *emul_pair(uint32_t subject_id,
+					 uint32_t object_id, int add)
+{
+	struct smack_pair_slot *slot;
+	uint64_t key = (uint64_t) subject_id << 32 | object_id;
+	uint32_t pos;
+
+	if (add && (emul_pairs == NULL ||
+		    (uint64_t) (emul_pairs_cnt + 1) * 4 >
+		    (uint64_t) (emul_pairs_mask + 1) * 3))
+		if (emul_pairs_resize())
+			return NULL;
+	if (emul_pairs == NULL)
+		return NULL;
+
+	pos = (key * PAIRS_GOLDEN) >> 32 & emul_pairs_mask;
+	for (;; pos = (pos + 1) & emul_pairs_mask) {
+		slot = &emul_pairs[pos];
+		if (slot->subject_id == subject_id &&
+		    slot->object_id == object_id)
+			return slot;
+		if (slot->subject_id == PAIR_EMPTY)
+			break;
+	}
+
+	if (!add)
+		return NULL;
+
+	slot->subject_id = subject_id;
+	slot->object_id = object_id;
+	slot->allow_code = 0;
+	emul_pairs_cnt++;
+	return slot;
+}
+
+/* Writes the rules with any access in the format of reading load2 */
+static int emul_dump(FILE *file)
+{
+	struct smack_pair_slot *slot;
+	uint32_t i;
+
+	for (i = 0; emul_pairs != NULL && i <= emul_pairs_mask; ++i) {
+		slot = &emul_pairs[i];
+		if (slot->subject_id == PAIR_EMPTY || slot->allow_code == 0)
+			continue;
+		if (fprintf(file, KERNEL_LONG_FORMAT "\n",
+			    label_str(emul_labels, slot->subject_id),
+			    label_str(emul_labels, slot->object_id),
+			    access_strs[slot->allow_code]) < 0)
+			return -1;
+	}
+
+	if (fflush(file) || fseek(file, 0, SEEK_SET))
+		return -1;
+	return 0;
+}
+
+static int emul_open(const char *name, int flags)
+{
+	struct emul_file *files;
+	struct stat st;
+	FILE *file;
+	int kind = EMUL_NONE;
+	int fd = -1;
+	int cnt;
+	size_t i;
+
+	for (i = 0; i < sizeof(emul_names) / sizeof(emul_names[0]); ++i)
+		if (!strcmp(name, emul_names[i].name))
+			kind = emul_names[i].kind;
+	if (kind == EMUL_NONE) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	file = tmpfile();
+	if (file == NULL)
+		return -1;
+
+	pthread_mutex_lock(&emul_lock);
+	if (emul_labels == NULL && smack_accesses_new(&emul_labels))
+		goto out;
+	if (kind == EMUL_LOAD && (flags & O_ACCMODE) == O_RDONLY &&
+	    emul_dump(file))
+		goto out;
+
+	fd = fcntl(fileno(file), flags & O_CLOEXEC ? F_DUPFD_CLOEXEC : F_DUPFD,
+		   0);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &st))
+		goto err_out;
+
+	if (fd >= emul_files_cnt) {
+		cnt = emul_files_cnt ? emul_files_cnt : 64;
+		while (cnt <= fd)
+			cnt <<= 1;
+		files = realloc(emul_files, cnt * sizeof(struct emul_file));
+		if (files == NULL)
+			goto err_out;
+		memset(files + emul_files_cnt, 0,
+		       (cnt - emul_files_cnt) * sizeof(struct emul_file));
+		emul_files = files;
+		emul_files_cnt = cnt;
+	}
+
+	emul_files[fd].dev = st.st_dev;
+	emul_files[fd].ino = st.st_ino;
+	emul_files[fd].kind = kind;
+	goto out;
+
+err_out:
+	close(fd);
+	fd = -1;
+out:
+	pthread_mutex_unlock(&emul_lock);
+	fclose(file);
+	return fd;
+}
+
+/* Applies one line of a load2 or change-rule write */
+static int emul_rule(const char **pos, const char *end, int change)
+{
+	struct smack_pair_slot *slot;
+	const char *p = *pos;
+	int subject_id;
+	int object_id;
+	int allow;
+	int deny = 0;
+
+	subject_id = parse_label(emul_labels, &p, end);
+	if (subject_id < 0)
+		goto err_out;
+	object_id = parse_label(emul_labels, &p, end);
+	if (object_id < 0)
+		goto err_out;
+	allow = parse_access_code(&p, end);
+	if (allow < 0)
+		goto err_out;
+	if (change) {
+		deny = parse_access_code(&p, end);
+		if (deny < 0)
+			goto err_out;
+	}
+	p = skip_blanks(p, end);
+	if (p < end && *p != '\n')
+		goto err_out;
+
+	slot = emul_pair(subject_id, object_id, 1);
+	if (slot == NULL)
+		return -1;
+	if (change)
+		slot->allow_code = (slot->allow_code | allow) & ~deny;
+	else
+		slot->allow_code = allow;
+
+	*pos = p < end ? p + 1 : p;
+	return 0;
+
+err_out:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Takes a write of rules the way the kernel does: at most one page less a
+ * byte is looked at, and if the write is longer, only up to the last line
+ * that is complete in there. Rules before a bad one stay applied. Returns
+ * the number of bytes taken.
+ */
+static ssize_t emul_write_rules(const char *buf, size_t len, int change)
+{
+	const char *end = buf + len;
+	const char *p = buf;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (len >= (size_t) page) {
+		end = buf + page - 1;
+		while (end > buf && end[-1] != '\n')
+			--end;
+		if (end == buf) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	while (p < end)
+		if (emul_rule(&p, end, change))
+			return -1;
+
+	return end - buf;
+}
+
+/* Answers an access2 query, the answer is read from the file start */
+static ssize_t emul_write_access(int fd, const char *buf, size_t len)
+{
+	struct smack_pair_slot *slot;
+	const char *end = buf + len;
+	const char *p = buf;
+	int subject_id;
+	int object_id;
+	int request;
+	int allow;
+
+	subject_id = parse_label(emul_labels, &p, end);
+	object_id = subject_id < 0 ? -1 : parse_label(emul_labels, &p, end);
+	request = object_id < 0 ? -1 : parse_access_code(&p, end);
+	if (request < 0 || skip_blanks(p, end) != end) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	allow = builtin_access(label_str(emul_labels, subject_id),
+			       emul_labels->labels[subject_id].len,
+			       label_str(emul_labels, object_id),
+			       emul_labels->labels[object_id].len, request);
+	if (allow < 0) {
+		slot = emul_pair(subject_id, object_id, 0);
+		allow = slot != NULL && slot->allow_code > 0 &&
+			(request & slot->allow_code) == request;
+	}
+
+	if (pwrite(fd, allow ? "1" : "0", 1, 0) < 0)
+		return -1;
+	return len;
+}
+
+/* Takes a cipso2 or revoke-subject write, only its label is checked */
+static ssize_t emul_write_label(const char *buf, size_t len, int revoke)
+{
+	const char *p = buf;
+	uint32_t i;
+	int id;
+
+	id = parse_label(emul_labels, &p, buf + len);
+	if (id < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; revoke && emul_pairs != NULL && i <= emul_pairs_mask; ++i)
+		if (emul_pairs[i].subject_id == (uint32_t) id)
+			emul_pairs[i].allow_code = 0;
+
+	return len;
+}
+
+static ssize_t emul_write(int fd, const void *buf, size_t len)
+{
+	struct stat st;
+	ssize_t ret;
+	int kind = EMUL_NONE;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	pthread_mutex_lock(&emul_lock);
+	if (fd < emul_files_cnt && emul_files[fd].dev == st.st_dev &&
+	    emul_files[fd].ino == st.st_ino)
+		kind = emul_files[fd].kind;
+
+	switch (kind) {
+	case EMUL_LOAD:
+	case EMUL_CHANGE:
+		ret = emul_write_rules(buf, len, kind == EMUL_CHANGE);
+		break;
+	case EMUL_ACCESS:
+		ret = emul_write_access(fd, buf, len);
+		break;
+	case EMUL_CIPSO:
+	case EMUL_REVOKE:
+		ret = emul_write_label(buf, len, kind == EMUL_REVOKE);
+		break;
+	case EMUL_OTHER:
+		ret = len;
+		break;
+	default:
+		ret = -2;
+		break;
+	}
+	pthread_mutex_unlock(&emul_lock);
+
+	/* Not a file of the emulation */
+	if (ret == -2)
+		ret = write(fd, buf, len);
+
+	return ret;
+}
+
+/* Opens a file of smackfs or of the backend that stands in for it */
+static int smackfs_open(const char *name, int flags)
+{
+	if (smackfs_emulated)
+		return emul_open(name, flags);
+	return openat(smackfs_mnt_dirfd, name, flags);
+}
+
+static ssize_t smackfs_write(int fd, const void *buf, size_t len)
+{
+	if (smackfs_emulated)
+		return emul_write(fd, buf, len);
+	return write(fd, buf, len);
+}
+
+static int open_smackfs_file(const char *long_name, const char *short_name,
+			     mode_t mode, int *use_long)
+{
+	int fd;
+
+	fd = smackfs_open(long_name, mode);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			return -1;
+
+		fd = smackfs_open(short_name, mode);
+		if (fd < 0)
+			return -1;
+
+		*use_long = 0;
+		return fd;
+	}
+
+	*use_long = 1;
+	return fd;
+}
+
+static inline int check_multiline(int change_fd)
+{
+	/* This string will be written to kernel Smack "change-rule" interface
+	 * to check if it can handle multiple rules in one write.
+	 * It consists of two rules, separated by '\n': first that does nothing
+	 * and second that has invalid format. If kernel parses only the first
+	 * line (pre-3.12 behavior), it won't see the invalid rule and succeed.
+	 * If it parses both lines, an error will be returned.
+	 */
+	static const char test_str[] = "^ ^ - -\n-";
+	int ret;
 
-		offset = ret;
-		buf[offset++] = ' ';
+	/* A file in a directory would take the test string as rules,
+	 * write the way current kernels take them */
+	if (smackfs_directory)
+		return 1;
 
-		ret = snprintf(buf + offset, buf_len - offset, CIPSO_NUM_LEN_STR, m->level);
-		if (ret < 0 || offset + ret >= buf_len)
-			goto err_out;
-		offset += ret;
+	ret = smackfs_write(change_fd, test_str, sizeof(test_str) - 1);
+	if (ret == -1 && errno == EINVAL)
+		return 1;
+	return 0;
+}
 
-		ret = snprintf(buf + offset, buf_len - offset, CIPSO_NUM_LEN_STR, m->ncats);
-		if (ret < 0 || offset + ret >= buf_len)
-			goto err_out;
-		offset += ret;
+/*
+ * Writes len bytes to fd, retrying interrupted and partial writes, and
+ * counts them in stats if it is given.
+ */
+static int write_all(int fd, const char *buf, int len,
+		     struct write_stats *stats)
+{
+	uint64_t start = 0;
+	int pos;
+	int ret;
 
-		for (i = 0; i < CAT_MAX_COUNT; i++) {
-			if (BITTEST(m->cats, i)) {
-				ret = snprintf(buf + offset, buf_len - offset,
-					CIPSO_NUM_LEN_STR, i + 1);
-				if (ret < 0 || offset + ret >= buf_len)
-					goto err_out;
-				offset += ret;
-			}
-		}
+	if (stats != NULL)
+		start = clock_ns();
 
-		if (write(fd, buf, offset) < 0)
-			goto err_out;
+	for (pos = 0; pos < len; ) {
+		ret = smackfs_write(fd, buf + pos, len - pos);
+		if (stats != NULL)
+			stats->writes++;
+		if (ret == -1) {
+			if (errno != EINTR)
+				break;
+			if (stats != NULL)
+				stats->retries++;
+		} else
+			pos += ret;
 	}
 
-	close(fd);
-	return 0;
+	if (stats != NULL) {
+		stats->bytes += pos;
+		stats->write_ns += clock_ns() - start;
+	}
 
-err_out:
-	close(fd);
-	return -1;
+	return pos < len ? -1 : 0;
 }
 
-int smack_cipso_add_from_file(struct smack_cipso *cipso, int fd)
+static int buffer_reserve(struct smack_file_buffer *buffer, int size)
 {
-	struct cipso_mapping *mapping = NULL;
-	FILE *file = NULL;
-	char *buf = NULL;
-	size_t buf_size = 0;
-	char *label, *level, *cat, *ptr;
-	long int val;
-	int i;
-	int newfd;
+	char *buf;
 
-	newfd = dup(fd);
-	if (newfd == -1)
-		return -1;
+	if (buffer->fd < 0 || buffer->size >= size)
+		return 0;
 
-	file = fdopen(newfd, "r");
-	if (file == NULL) {
-		close(newfd);
+	buf = realloc(buffer->buf, size);
+	if (buf == NULL)
 		return -1;
-	}
 
-	while (getline(&buf, &buf_size, file) >= 0) {
-		mapping = calloc(1, sizeof(struct cipso_mapping));
-		if (mapping == NULL)
-			goto err_out;
+	buffer->buf = buf;
+	buffer->size = size;
+	return 0;
+}
 
-		label = strtok_r(buf, " \t\n", &ptr);
-		level = strtok_r(NULL, " \t\n", &ptr);
-		cat = strtok_r(NULL, " \t\n", &ptr);
+static void *write_ring_run(void *arg)
+{
+	struct write_ring *ring = arg;
+	struct write_job job;
+	int error;
+
+	pthread_mutex_lock(&ring->lock);
+	for (;;) {
+		while (ring->queued == 0 && !ring->done)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (ring->queued == 0)
+			break;
 
-		if (level == NULL)
-			goto err_out;
+		job = ring->jobs[ring->head];
+		ring->head = (ring->head + 1) % WRITE_RING_SIZE;
+		ring->queued--;
+		error = ring->error;
+		pthread_mutex_unlock(&ring->lock);
 
-		val  = get_label(mapping->label, label, NULL);
-		if (val < 0)
-			goto err_out;
-		if (val > SHORT_LABEL_LEN)
-			cipso->has_long = 1;
+		/* After a failure the remaining chunks are dropped */
+		if (!error && write_all(job.fd, job.buf, job.len, job.stats))
+			error = 1;
 
-		errno = 0;
-		val = strtol(level, NULL, 10);
-		if (errno)
-			goto err_out;
+		pthread_mutex_lock(&ring->lock);
+		ring->free_bufs[ring->free_cnt++] = job.buf;
+		ring->error |= error;
+		pthread_cond_broadcast(&ring->cond);
+	}
+	pthread_mutex_unlock(&ring->lock);
 
-		if (val < 0 || val > LEVEL_MAX)
-			goto err_out;
+	return NULL;
+}
 
-		mapping->level = val;
+static void write_ring_free(struct write_ring *ring)
+{
+	int i;
 
-		for (i = 0; i < CAT_MAX_COUNT && cat != NULL; i++) {
-			errno = 0;
-			val = strtol(cat, NULL, 10);
-			if (errno)
-				goto err_out;
+	for (i = 0; i < WRITE_RING_SIZE; ++i)
+		free(ring->bufs[i]);
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+}
 
-			if (val <= 0 || val > CAT_MAX_COUNT)
-				goto err_out;
+/*
+ * Starts a writer thread with buffers of the given size. Returns NULL if
+ * that is not possible.
+ */
+static struct write_ring *write_ring_new(int size)
+{
+	struct write_ring *ring;
+	int i;
 
-			if (!BITTEST(mapping->cats, val - 1)) {
-				BITSET(mapping->cats, val - 1);
-				++(mapping->ncats);
-			}
+	ring = calloc(1, sizeof(struct write_ring));
+	if (ring == NULL)
+		return NULL;
 
-			cat = strtok_r(NULL, " \t\n", &ptr);
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	ring->size = size;
+	for (i = 0; i < WRITE_RING_SIZE; ++i) {
+		ring->bufs[i] = malloc(size);
+		if (ring->bufs[i] == NULL) {
+			write_ring_free(ring);
+			return NULL;
 		}
+		ring->free_bufs[ring->free_cnt++] = ring->bufs[i];
+	}
 
-		if (cipso->first == NULL) {
-			cipso->first = cipso->last = mapping;
-		} else {
-			cipso->last->next = mapping;
-			cipso->last = mapping;
-		}
+	if (pthread_create(&ring->thread, NULL, write_ring_run, ring)) {
+		write_ring_free(ring);
+		return NULL;
 	}
 
-	if (ferror(file))
-		goto err_out;
+	return ring;
+}
 
-	fclose(file);
-	free(buf);
-	return 0;
-err_out:
-	fclose(file);
-	free(mapping);
-	free(buf);
-	return -1;
+/* Gives the buffer an empty chunk of the ring to fill */
+static void write_ring_attach(struct write_ring *ring,
+			      struct smack_file_buffer *buffer)
+{
+	pthread_mutex_lock(&ring->lock);
+	buffer->buf = ring->free_bufs[--ring->free_cnt];
+	pthread_mutex_unlock(&ring->lock);
+
+	buffer->ring = ring;
+	buffer->size = ring->size;
+	buffer->pos = 0;
 }
 
-const char *smack_smackfs_path(void)
+/* Queues the filled chunk of the buffer and waits for an empty one */
+static int write_ring_submit(struct write_ring *ring,
+			     struct smack_file_buffer *buffer)
 {
-	if (init_smackfs_mnt())
-		return NULL;
-	return smackfs_mnt;
+	struct write_job *job;
+	int ret;
+
+	pthread_mutex_lock(&ring->lock);
+	job = &ring->jobs[(ring->head + ring->queued) % WRITE_RING_SIZE];
+	job->fd = buffer->fd;
+	job->len = buffer->pos;
+	job->buf = buffer->buf;
+	job->stats = buffer->stats;
+	ring->queued++;
+	pthread_cond_broadcast(&ring->cond);
+
+	while (ring->free_cnt == 0)
+		pthread_cond_wait(&ring->cond, &ring->lock);
+	buffer->buf = ring->free_bufs[--ring->free_cnt];
+	ret = ring->error ? -1 : 0;
+	pthread_mutex_unlock(&ring->lock);
+
+	buffer->pos = 0;
+	return ret;
 }
 
-static ssize_t smack_new_label_from_proc(const char *proc_path, char **label)
+/* Waits until everything queued has been written and frees the ring */
+static int write_ring_finish(struct write_ring *ring)
 {
-	char buf[SMACK_LABEL_LEN + 1];
-	char *result;
-	int fd;
 	int ret;
 
-	fd = open(proc_path, O_RDONLY);
-	if (fd < 0)
-		return -1;
+	pthread_mutex_lock(&ring->lock);
+	ring->done = 1;
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->lock);
 
-	ret = read(fd, buf, SMACK_LABEL_LEN);
-	close(fd);
-	if (ret < 0)
-		return -1;
+	pthread_join(ring->thread, NULL);
+	ret = ring->error ? -1 : 0;
+	write_ring_free(ring);
+	return ret;
+}
 
-	buf[ret] = '\0';
+/*
+ * Opens the files that rules are written to and finds out what the
+ * kernel supports.
+ */
+static int session_open(struct smack_session *session)
+{
+	struct smack_file_buffer *load_buffer = &session->load_buffer;
+	struct smack_file_buffer *change_buffer = &session->change_buffer;
 
-	result = calloc(1, ret + 1);
-	if (result == NULL)
+	memset(load_buffer, 0, sizeof(*load_buffer));
+	memset(change_buffer, 0, sizeof(*change_buffer));
+	load_buffer->fd = -1;
+	change_buffer->fd = -1;
+	session->use_long = 1;
+	session->multiline = 0;
+
+	if (init_smackfs_mnt())
 		return -1;
 
-	ret = get_label(result, buf, NULL);
-	if (ret < 0) {
-		free(result);
+	load_buffer->chunk = sysconf(_SC_PAGESIZE);
+	load_buffer->size = load_buffer->chunk + LOAD_LEN;
+	change_buffer->chunk = load_buffer->chunk;
+	change_buffer->size = load_buffer->size;
+
+	load_buffer->fd = open_smackfs_file("load2", "load",
+					    O_WRONLY | O_CLOEXEC,
+					    &session->use_long);
+	if (load_buffer->fd < 0)
 		return -1;
+	load_buffer->buf = malloc(load_buffer->size);
+	if (load_buffer->buf == NULL)
+		return -1;
+
+	change_buffer->fd = smackfs_open("change-rule", O_WRONLY | O_CLOEXEC);
+	if (change_buffer->fd >= 0) {
+		change_buffer->buf = malloc(change_buffer->size);
+		if (change_buffer->buf == NULL)
+			return -1;
+
+		session->multiline = check_multiline(change_buffer->fd);
+	} else {
+		/* Try to continue if "change-rule" doesn't exist, we might
+		 * not need it. */
+		if (errno != ENOENT)
+			return -1;
 	}
 
-	*label = result;
-	return ret;
+	return 0;
 }
 
-ssize_t smack_new_label_from_self(char **label)
+static void session_close(struct smack_session *session)
 {
-	ssize_t ret = smack_new_label_from_proc(SELF_LABEL_FILE, label);
-	if (ret < 0 && errno == ENOENT)
-		ret = smack_new_label_from_proc(OLD_SELF_LABEL_FILE, label);
-	return ret;
+	if (session->load_buffer.fd >= 0)
+		close(session->load_buffer.fd);
+	if (session->change_buffer.fd >= 0)
+		close(session->change_buffer.fd);
+	free(session->load_buffer.buf);
+	free(session->change_buffer.buf);
 }
 
-ssize_t smack_new_label_from_process(pid_t pid, char **label)
+/*
+ * Writes the rules of handle to the kernel, or with old_handle given only
+ * the difference between the two.
+ */
+static int session_write(struct smack_session *session,
+			 struct smack_accesses *handle,
+			 struct smack_accesses *old_handle, int clear)
 {
-	char path[sizeof(PID_LABEL_FILE) + 20];
+	struct smack_accesses_stats *stats = &handle->stats;
+	struct smack_file_buffer load_buffer;
+	struct smack_file_buffer change_buffer;
+	struct write_stats load_stats = {0};
+	struct write_stats change_stats = {0};
+	struct write_ring *ring = NULL;
+	int size = handle->write_chunk + LOAD_LEN;
+	uint64_t start;
 	int ret;
-	ssize_t retval;
 
-	ret = snprintf(path, sizeof(path), PID_LABEL_FILE, pid);
-	if (ret < 0 || ret >= (int) sizeof(path))
+	if (handle->write_pipelined)
+		ring = write_ring_new(size);
+
+	/* Without a writer thread, or if it cannot be started, the rules
+	 * are written from the session buffers */
+	if (ring == NULL &&
+	    (buffer_reserve(&session->load_buffer, size) ||
+	     buffer_reserve(&session->change_buffer, size)))
 		return -1;
-	retval = smack_new_label_from_proc(path, label);
-	if (retval < 0 && errno == ENOENT) {
-		ret = snprintf(path, sizeof(path), OLD_PID_LABEL_FILE, pid);
-		if (ret < 0 || ret >= (int) sizeof(path))
-			return -1;
-		retval = smack_new_label_from_proc(path, label);
+
+	load_buffer = session->load_buffer;
+	change_buffer = session->change_buffer;
+	load_buffer.chunk = handle->write_chunk;
+	change_buffer.chunk = handle->write_chunk;
+	load_buffer.stats = &load_stats;
+	change_buffer.stats = &change_stats;
+	stats->merge_ns = 0;
+	start = clock_ns();
+	SMACK_PROBE2(apply_entry, handle, clear);
+	if (ring != NULL) {
+		write_ring_attach(ring, &load_buffer);
+		if (change_buffer.fd >= 0)
+			write_ring_attach(ring, &change_buffer);
 	}
-	return retval;
+
+	if (old_handle)
+		ret = accesses_print_diff(old_handle, handle,
+					  session->use_long,
+					  session->multiline,
+					  &load_buffer, &change_buffer);
+	else
+		ret = accesses_print(handle, clear, session->use_long,
+				     session->multiline,
+				     &load_buffer, &change_buffer);
+
+	if (ring != NULL && write_ring_finish(ring))
+		ret = -1;
+
+	stats->load_rules = load_stats.rules;
+	stats->load_bytes = load_stats.bytes;
+	stats->change_rules = change_stats.rules;
+	stats->change_bytes = change_stats.bytes;
+	stats->writes = load_stats.writes + change_stats.writes;
+	stats->write_retries = load_stats.retries + change_stats.retries;
+	stats->write_ns = load_stats.write_ns + change_stats.write_ns;
+	stats->format_ns = clock_ns() - start - stats->merge_ns -
+		load_stats.flush_ns - change_stats.flush_ns;
+	SMACK_PROBE4(apply_return, ret,
+		     stats->load_rules + stats->change_rules,
+		     stats->load_bytes + stats->change_bytes, stats->writes);
+
+	/* Also after a failure, some of the rules may have been written */
+	generation_bump();
+	return ret;
 }
 
-ssize_t smack_new_label_from_socket(int fd, char **label)
+static int accesses_apply(struct smack_accesses *handle,
+			  struct smack_accesses *old_handle, int clear)
 {
-	char buf[SMACK_LABEL_LEN + 2];
-	int ret;
-	socklen_t length = SMACK_LABEL_LEN + 1;
-	char *result;
+	struct smack_session session;
+	int ret = -1;
 
-	/* If getsockopt return more then SMACK_LABEL_LEN the
-	 * buf does not contain proper smack label and get_label
-	 * will return error. */
-	ret = getsockopt(fd, SOL_SOCKET, SO_PEERSEC, buf, &length);
-	if (ret < 0)
-		return -1;
+	if (session_open(&session) == 0)
+		ret = session_write(&session, handle, old_handle, clear);
 
-	buf[length] = '\0';
+	session_close(&session);
+	return ret;
+}
 
-	result = calloc(1, length + 1);
+int smack_session_new(struct smack_session **session)
+{
+	struct smack_session *result;
+
+	result = calloc(1, sizeof(struct smack_session));
 	if (result == NULL)
 		return -1;
 
-	ret = get_label(result, buf, NULL);
-	if (ret < 0) {
+	if (session_open(result)) {
+		session_close(result);
 		free(result);
 		return -1;
 	}
 
-	*label = result;
-	return ret;
+	if (access(SELF_LABEL_FILE, F_OK) == 0)
+		result->self_label_file = SELF_LABEL_FILE;
+	else
+		result->self_label_file = OLD_SELF_LABEL_FILE;
+
+	/* The access file is opened on the first check */
+	result->access.fd = -1;
+	result->access.reuse = 1;
+
+	*session = result;
+	return 0;
 }
 
-ssize_t smack_new_label_from_path(const char *path, const char *xattr, 
-				  int follow, char **label)
+void smack_session_free(struct smack_session *session)
 {
-	char buf[SMACK_LABEL_LEN + 1];
-	char *result;
-	ssize_t ret = 0;
+	if (session == NULL)
+		return;
 
-	ret = follow ?
-		getxattr(path, xattr, buf, SMACK_LABEL_LEN + 1) :
-		lgetxattr(path, xattr, buf, SMACK_LABEL_LEN + 1);
-	if (ret < 0)
-		return -1;
-	buf[ret] = '\0';
+	session_close(session);
+	if (session->access.fd >= 0)
+		close(session->access.fd);
+	free(session);
+}
 
-	result = calloc(1, ret + 1);
-	if (result == NULL)
-		return -1;
+int smack_session_apply(struct smack_session *session,
+			struct smack_accesses *handle)
+{
+	return session_write(session, handle, NULL, 0);
+}
 
-	ret = get_label(result, buf, NULL);
-	if (ret < 0) {
-		free(result);
+int smack_session_apply_diff(struct smack_session *session,
+			     struct smack_accesses *old_handle,
+			     struct smack_accesses *new_handle)
+{
+	return session_write(session, new_handle, old_handle, 0);
+}
+
+int smack_session_clear(struct smack_session *session,
+			struct smack_accesses *handle)
+{
+	return session_write(session, handle, NULL, 1);
+}
+
+/*
+ * Reads rules from fd and writes them through the session in batches, so
+ * that no more than about max_memory bytes are held at once. Every batch
+ * is merged per subject and object pair like a whole handle would be.
+ * Merging is the composition of the changes of the rules, so writing the
+ * batches one after another in file order leaves the kernel with the same
+ * rules as writing them at once.
+ */
+static int session_stream(struct smack_session *session, int fd,
+			  size_t max_memory, int clear)
+{
+	struct smack_accesses *handle;
+	int ret;
+
+	if (smack_accesses_new(&handle))
 		return -1;
-	}
 
-	*label = result;
+	ret = accesses_read(handle, fd, session, max_memory, clear);
+	if (ret == 0 && (handle->rules_cnt > 0 || handle->new_rules_cnt > 0))
+		ret = session_write(session, handle, NULL, clear);
+
+	smack_accesses_free(handle);
 	return ret;
 }
 
-ssize_t smack_new_label_from_file(int fd, const char *xattr, 
-				  char **label)
+int smack_session_apply_from_file(struct smack_session *session, int fd,
+				  size_t max_memory)
 {
-	char buf[SMACK_LABEL_LEN + 1];
-	char *result;
-	ssize_t ret = 0;
+	return session_stream(session, fd, max_memory, 0);
+}
 
-	ret = fgetxattr(fd, xattr, buf, SMACK_LABEL_LEN + 1);
-	if (ret < 0)
-		return -1;
-	buf[ret] = '\0';
+int smack_session_clear_from_file(struct smack_session *session, int fd,
+				  size_t max_memory)
+{
+	return session_stream(session, fd, max_memory, 1);
+}
 
-	result = calloc(1, ret + 1);
-	if (result == NULL)
-		return -1;
+int smack_session_have_access(struct smack_session *session,
+			      const char *subject, const char *object,
+			      const char *access_type)
+{
+	struct smack_access_query query = {
+		.subject = subject,
+		.object = object,
+		.access_type = access_type,
+	};
 
-	ret = get_label(result, buf, NULL);
-	if (ret < 0) {
-		free(result);
+	if (access_query(&session->access, &query))
 		return -1;
-	}
 
-	*label = result;
-	return ret;
+	return query.result;
 }
 
-int smack_set_label_for_path(const char *path,
-				  const char *xattr,
-				  int follow,
-				  const char *label)
+ssize_t smack_session_new_label_from_self(struct smack_session *session,
+					  char **label)
 {
-	int len;
+	return smack_new_label_from_proc(session->self_label_file, label);
+}
 
-	len = (int)smack_label_length(label);
-	if (len < 0)
-		return -2;
+static int buffer_flush(struct smack_file_buffer *buf)
+{
+	uint64_t start = 0;
+	int ret;
 
-	return follow ?
-		setxattr(path, xattr, label, len, 0) :
-		lsetxattr(path, xattr, label, len, 0);
+	if (buf->stats != NULL)
+		start = clock_ns();
+
+	SMACK_PROBE2(flush_entry, buf->fd, buf->pos);
+	if (buf->ring != NULL) {
+		ret = write_ring_submit(buf->ring, buf);
+	} else {
+		/* Write buffered bytes to kernel */
+		ret = write_all(buf->fd, buf->buf, buf->pos, buf->stats);
+		buf->pos = 0;
+	}
+
+	SMACK_PROBE1(flush_return, ret);
+	if (buf->stats != NULL)
+		buf->stats->flush_ns += clock_ns() - start;
+	return ret;
 }
 
-int smack_set_label_for_file(int fd,
-				  const char *xattr,
-				  const char *label)
+static inline int rule_print_long(struct smack_file_buffer *buffer,
+	const char *subject, int slen, const char *object, int olen,
+	const char *allow_str, const char *deny_str)
 {
-	int len;
+	if (buffer->pos + slen + 1 + olen + 1 + ACC_LEN >= buffer->size)
+		return -1;
 
-	len = (int)smack_label_length(label);
-	if (len < 0)
-		return -2;
+	memcpy(buffer->buf + buffer->pos, subject, slen);
+	buffer->pos += slen;
+	buffer->buf[buffer->pos++] = ' ';
+	memcpy(buffer->buf + buffer->pos, object, olen);
+	buffer->pos += olen;
+	buffer->buf[buffer->pos++] = ' ';
+	memcpy(buffer->buf + buffer->pos, allow_str, ACC_LEN);
+	buffer->pos += ACC_LEN;
+	if (deny_str != NULL) {
+		if (buffer->pos + 1 + ACC_LEN >= buffer->size)
+			return -1;
+		buffer->buf[buffer->pos++] = ' ';
+		memcpy(buffer->buf + buffer->pos, deny_str, ACC_LEN);
+		buffer->pos += ACC_LEN;
+	}
 
-	return fsetxattr(fd, xattr, label, len, 0);
+	return 0;
 }
 
-int smack_remove_label_for_path(const char *path,
-				  const char *xattr,
-				  int follow)
+/*
+ * Writes a rule in the short format, the same as KERNEL_SHORT_FORMAT but
+ * without going through snprintf(). Labels must not be longer than
+ * SHORT_LABEL_LEN. Returns the length, always SHORT_RULE_LEN.
+ */
+static inline int short_rule_render(char *buf, const char *subject, int slen,
+				    const char *object, int olen,
+				    const char *access_str)
 {
-	return follow ? removexattr(path, xattr) : lremovexattr(path, xattr);
+	memcpy(buf, subject, slen);
+	memset(buf + slen, ' ', SHORT_LABEL_LEN + 1 - slen);
+	buf += SHORT_LABEL_LEN + 1;
+	memcpy(buf, object, olen);
+	memset(buf + olen, ' ', SHORT_LABEL_LEN + 1 - olen);
+	buf += SHORT_LABEL_LEN + 1;
+	memcpy(buf, access_str, SHORT_ACC_LEN);
+
+	return SHORT_RULE_LEN;
 }
 
-int smack_remove_label_for_file(int fd, const char *xattr)
+static inline int rule_print_short(struct smack_file_buffer *buffer,
+	const char *subject, int slen, const char *object, int olen,
+	const char *access_str)
 {
-	return fremovexattr(fd, xattr);
+	if (buffer->pos + SHORT_RULE_LEN >= buffer->size)
+		return -1;
+
+	buffer->pos += short_rule_render(buffer->buf + buffer->pos,
+					 subject, slen, object, olen,
+					 access_str);
+	return 0;
 }
 
-int smack_set_label_for_self(const char *label)
+/*
+ * Merges the rules of subject x into handle->merge_perms, indexed by object
+ * id, and lists the objects in handle->merge_object_ids in the order of
+ * their first rule. Returns the number of objects. Entries must be reset
+ * to zero by the caller.
+ */
+static int subject_merge(struct smack_accesses *handle, int x, int clear)
+{
+	struct smack_rule *rule;
+	union smack_perm *perm;
+	uint32_t i;
+	int merge_cnt = 0;
+
+	for (i = handle->rules_start[x]; i < handle->rules_start[x + 1]; ++i) {
+		rule = &handle->rules[i];
+		perm = &(handle->merge_perms[rule->object_id]);
+		if (perm->allow_deny_code == 0)
+			handle->merge_object_ids[merge_cnt++] = rule->object_id;
+
+		if (clear) {
+			perm->allow_code = 0;
+			perm->deny_code  = ACCESS_TYPE_ALL;
+		} else {
+			perm->allow_code |=  rule->perm.allow_code;
+			perm->allow_code &= ~rule->perm.deny_code;
+			perm->deny_code  &= ~rule->perm.allow_code;
+			perm->deny_code  |=  rule->perm.deny_code;
+		}
+	}
+
+	return merge_cnt;
+}
+
+/*
+ * Formats the merged rule of a subject and object pair into the load or
+ * the change-rule buffer and flushes the buffer when it is due.
+ */
+static int rule_emit(struct smack_accesses *handle, int subject_id,
+		     int object_id, union smack_perm perm,
+		     int use_long, int multiline,
+		     struct smack_file_buffer *load_buffer,
+		     struct smack_file_buffer *change_buffer)
 {
+	struct smack_file_buffer *buffer;
+	const char *subject = label_str(handle, subject_id);
+	const char *object = label_str(handle, object_id);
+	const char *allow_str;
+	int slen = handle->labels[subject_id].len;
+	int olen = handle->labels[object_id].len;
+	int modify;
 	int len;
-	int fd;
 	int ret;
 
-	len = get_label(NULL, label, NULL);
-	if (len < 0)
-		return -1;
+	modify = (perm.allow_code | perm.deny_code) != ACCESS_TYPE_ALL;
+	if (modify) {
+		/* Fail immediately without doing any further processing
+		   if modify rules are not supported. */
+		if (change_buffer->fd < 0)
+			return -1;
 
-	fd = open(SELF_LABEL_FILE, O_WRONLY);
-	if (fd < 0)
-		return -1;
+		buffer = change_buffer;
+		len = slen + olen + 2 * ACC_LEN + 3;
+	} else {
+		buffer = load_buffer;
+		len = use_long ?
+			slen + olen + ACC_LEN + 2 :
+			SHORT_RULE_LEN;
+	}
 
-	ret = write(fd, label, len);
-	close(fd);
+	/* Chunks hold whole rules only, start a new one if the rule and
+	 * its newline do not fit anymore */
+	if (buffer->pos > 0 && buffer->pos + len + 1 > buffer->chunk)
+		if (buffer_flush(buffer))
+			return -1;
 
-	return (ret < 0) ? -1 : 0;
+	allow_str = access_strs[perm.allow_code & ACCESS_TYPE_ALL];
+	if (modify) {
+		ret = rule_print_long(buffer, subject, slen, object, olen,
+			allow_str, access_strs[perm.deny_code & ACCESS_TYPE_ALL]);
+	} else if (use_long) {
+		ret = rule_print_long(buffer, subject, slen, object, olen,
+			allow_str, NULL);
+	} else {
+		ret = rule_print_short(buffer, subject, slen, object, olen,
+			allow_str);
+	}
+
+	if (ret)
+		return ret;
+
+	if (buffer->stats != NULL)
+		buffer->stats->rules++;
+
+	if (multiline) {
+		buffer->buf[buffer->pos++] = '\n';
+	} else {
+		/* When no multi-line is supported, just flush
+		 * the rule that was just generated */
+		if (buffer_flush(buffer))
+			return -1;
+	}
+
+	return 0;
 }
 
-int smack_revoke_subject(const char *subject)
+static int buffers_flush(struct smack_file_buffer *load_buffer,
+			 struct smack_file_buffer *change_buffer)
 {
-	int ret;
-	int fd;
-	int len;
-
-	if (init_smackfs_mnt())
+	if (load_buffer->pos > 0 && buffer_flush(load_buffer))
+		return -1;
+	if (change_buffer->pos > 0 && buffer_flush(change_buffer))
 		return -1;
 
-	len = get_label(NULL, subject, NULL);
-	if (len < 0)
+	return 0;
+}
+
+static int accesses_print(struct smack_accesses *handle, int clear,
+			  int use_long, int multiline,
+			  struct smack_file_buffer *load_buffer,
+			  struct smack_file_buffer *change_buffer)
+{
+	union smack_perm *perm;
+	uint64_t start;
+	int merge_cnt;
+	int object_id;
+	int x;
+	int y;
+
+	if (!use_long && handle->has_long)
 		return -1;
 
-	fd = openat(smackfs_mnt_dirfd, "revoke-subject", O_WRONLY);
-	if (fd < 0)
+	start = clock_ns();
+	if (accesses_finalize(handle))
 		return -1;
+	handle->stats.merge_ns += clock_ns() - start;
 
-	ret = write(fd, subject, len);
-	close(fd);
+	load_buffer->pos = 0;
+	change_buffer->pos = 0;
+	bzero(handle->merge_perms, handle->labels_cnt * sizeof(union smack_perm));
+	for (x = 0; x < handle->labels_cnt; ++x) {
+		start = clock_ns();
+		merge_cnt = subject_merge(handle, x, clear);
+		handle->stats.merge_ns += clock_ns() - start;
 
-	return (ret < 0) ? -1 : 0;
-}
+		for (y = 0; y < merge_cnt; ++y) {
+			object_id = handle->merge_object_ids[y];
+			perm = &(handle->merge_perms[object_id]);
+			if (rule_emit(handle, x, object_id,
+				      *perm, use_long, multiline,
+				      load_buffer, change_buffer))
+				return -1;
+			perm->allow_deny_code = 0;
+		}
+	}
 
-ssize_t smack_label_length(const char *label)
-{
-	return get_label(NULL, label, NULL);
+	return buffers_flush(load_buffer, change_buffer);
 }
 
-static int open_smackfs_file(const char *long_name, const char *short_name,
-			     mode_t mode, int *use_long)
+/*
+ * Looks up every label of src in dst. map[x] is the id in dst of the label
+ * with id x in src, or -1 if dst does not know it.
+ */
+static int *label_map(struct smack_accesses *src, struct smack_accesses *dst)
 {
-	int fd;
-
-	fd = openat(smackfs_mnt_dirfd, long_name, mode);
-	if (fd < 0) {
-		if (errno != ENOENT)
-			return -1;
+	const char *label;
+	uint32_t hash;
+	int *map;
+	int len;
+	int x;
 
-		fd = openat(smackfs_mnt_dirfd, short_name, mode);
-		if (fd < 0)
-			return -1;
+	map = malloc(src->labels_cnt * sizeof(int) + 1);
+	if (map == NULL)
+		return NULL;
 
-		*use_long = 0;
-		return fd;
+	for (x = 0; x < src->labels_cnt; ++x) {
+		label = label_str(src, x);
+		len = src->labels[x].len;
+		label_span(label, label + len, &hash);
+		map[x] = is_label_known(dst, label, len, hash);
 	}
 
-	*use_long = 1;
-	return fd;
+	return map;
 }
 
-static inline int check_multiline(int change_fd)
+/*
+ * Emits the rules of one subject whose access differs between the two
+ * handles. Either old_x or new_x is -1 if the subject is known to one side
+ * only. The access of a pair is what it would be after clearing the rules
+ * and applying them again, so modify rules count with their allowed
+ * access and the differences are written as plain rules.
+ */
+static int subject_diff(struct smack_accesses *old_handle,
+			struct smack_accesses *new_handle, int old_x, int new_x,
+			const int *old_to_new, const int *new_to_old,
+			int use_long, int multiline,
+			struct smack_file_buffer *load_buffer,
+			struct smack_file_buffer *change_buffer)
 {
-	/* This string will be written to kernel Smack "change-rule" interface
-	 * to check if it can handle multiple rules in one write.
-	 * It consists of two rules, separated by '\n': first that does nothing
-	 * and second that has invalid format. If kernel parses only the first
-	 * line (pre-3.12 behavior), it won't see the invalid rule and succeed.
-	 * If it parses both lines, an error will be returned.
-	 */
-	static const char test_str[] = "^ ^ - -\n-";
-	int ret;
+	union smack_perm perm;
+	uint64_t start = clock_ns();
+	int8_t old_allow;
+	int old_cnt = 0;
+	int new_cnt = 0;
+	int old_id;
+	int new_id;
+	int ret = 0;
+	int y;
 
-	ret = write(change_fd, test_str, sizeof(test_str) - 1);
-	if (ret == -1 && errno == EINVAL)
-		return 1;
-	return 0;
+	if (old_x >= 0)
+		old_cnt = subject_merge(old_handle, old_x, 0);
+	if (new_x >= 0)
+		new_cnt = subject_merge(new_handle, new_x, 0);
+	new_handle->stats.merge_ns += clock_ns() - start;
+
+	/* Added or changed rules, old_handle->merge_perms of objects
+	 * without a rule for this subject are zero. A pair whose rules
+	 * change nothing counts as gone and is left to the loop below. An
+	 * object is listed again after such rules, PERM_DONE marks the
+	 * pairs already handled. */
+	for (y = 0; y < new_cnt && ret == 0; ++y) {
+		new_id = new_handle->merge_object_ids[y];
+		if (new_handle->merge_perms[new_id].allow_deny_code == 0 ||
+		    new_handle->merge_perms[new_id].deny_code & PERM_DONE)
+			continue;
+		new_handle->merge_perms[new_id].deny_code |= PERM_DONE;
+		old_id = new_to_old[new_id];
+		perm.allow_code = new_handle->merge_perms[new_id].allow_code;
+		perm.deny_code = ACCESS_TYPE_ALL & ~perm.allow_code;
+		old_allow = old_id >= 0 ?
+			old_handle->merge_perms[old_id].allow_code : 0;
+		if (perm.allow_code != old_allow)
+			ret = rule_emit(new_handle, new_x, new_id, perm,
+					use_long, multiline,
+					load_buffer, change_buffer);
+	}
+
+	/* Rules that are gone are set to no access */
+	perm.allow_code = 0;
+	perm.deny_code = ACCESS_TYPE_ALL;
+	for (y = 0; y < old_cnt && ret == 0; ++y) {
+		old_id = old_handle->merge_object_ids[y];
+		new_id = old_to_new[old_id];
+		if ((new_id < 0 ||
+		     new_handle->merge_perms[new_id].allow_deny_code == 0) &&
+		    old_handle->merge_perms[old_id].allow_code != 0 &&
+		    !(old_handle->merge_perms[old_id].deny_code & PERM_DONE)) {
+			old_handle->merge_perms[old_id].deny_code |= PERM_DONE;
+			ret = rule_emit(old_handle, old_x, old_id, perm,
+					use_long, multiline,
+					load_buffer, change_buffer);
+		}
+	}
+
+	for (y = 0; y < new_cnt; ++y)
+		new_handle->merge_perms[new_handle->merge_object_ids[y]].allow_deny_code = 0;
+	for (y = 0; y < old_cnt; ++y)
+		old_handle->merge_perms[old_handle->merge_object_ids[y]].allow_deny_code = 0;
+
+	return ret;
 }
 
-static int accesses_apply(struct smack_accesses *handle, int clear)
+static int accesses_print_diff(struct smack_accesses *old_handle,
+			       struct smack_accesses *new_handle,
+			       int use_long, int multiline,
+			       struct smack_file_buffer *load_buffer,
+			       struct smack_file_buffer *change_buffer)
 {
-	int ret;
-	int use_long = 1;
-	int multiline = 0;
-	struct smack_file_buffer load_buffer = {.fd = -1, .buf = NULL};
-	struct smack_file_buffer change_buffer = {.fd = -1, .buf = NULL};
+	int *old_to_new = NULL;
+	int *new_to_old = NULL;
+	uint64_t start;
+	int ret = -1;
+	int x;
 
-	if (init_smackfs_mnt())
+	if (!use_long && (old_handle->has_long || new_handle->has_long))
 		return -1;
 
-	load_buffer.size = handle->page_size + LOAD_LEN;
-	change_buffer.size = handle->page_size + LOAD_LEN;
-
-	load_buffer.fd = open_smackfs_file("load2", "load", O_WRONLY, &use_long);
-	if (load_buffer.fd < 0)
+	start = clock_ns();
+	if (accesses_finalize(old_handle) || accesses_finalize(new_handle))
 		return -1;
-	load_buffer.buf = malloc(load_buffer.size);
-	if (load_buffer.buf == NULL)
-		goto err_out;
+	new_handle->stats.merge_ns += clock_ns() - start;
 
-	change_buffer.fd = openat(smackfs_mnt_dirfd, "change-rule", O_WRONLY);
-	if (change_buffer.fd >= 0) {
-		change_buffer.buf = malloc(change_buffer.size);
-		if (change_buffer.buf == NULL)
-			goto err_out;
+	old_to_new = label_map(old_handle, new_handle);
+	new_to_old = label_map(new_handle, old_handle);
+	if (old_to_new == NULL || new_to_old == NULL)
+		goto out;
 
-		multiline = check_multiline(change_buffer.fd);
-	} else {
-		/* Try to continue if "change-rule" doesn't exist, we might
-		 * not need it. */
-		if (errno != ENOENT)
-			goto err_out;
-	}
+	load_buffer->pos = 0;
+	change_buffer->pos = 0;
+	bzero(old_handle->merge_perms,
+	      old_handle->labels_cnt * sizeof(union smack_perm));
+	bzero(new_handle->merge_perms,
+	      new_handle->labels_cnt * sizeof(union smack_perm));
+
+	for (x = 0; x < new_handle->labels_cnt; ++x)
+		if (subject_diff(old_handle, new_handle, new_to_old[x], x,
+				 old_to_new, new_to_old, use_long, multiline,
+				 load_buffer, change_buffer))
+			goto out;
 
-	ret = accesses_print(handle, clear, use_long, multiline,
-		&load_buffer, &change_buffer);
-	goto out;
+	for (x = 0; x < old_handle->labels_cnt; ++x)
+		if (old_to_new[x] < 0 &&
+		    subject_diff(old_handle, new_handle, x, -1,
+				 old_to_new, new_to_old, use_long, multiline,
+				 load_buffer, change_buffer))
+			goto out;
 
-err_out:
-	ret = -1;
+	ret = buffers_flush(load_buffer, change_buffer);
 out:
-	if (load_buffer.fd >= 0)
-		close(load_buffer.fd);
-	if (change_buffer.fd >= 0)
-		close(change_buffer.fd);
-	free(load_buffer.buf);
-	free(change_buffer.buf);
+	free(new_to_old);
+	free(old_to_new);
 	return ret;
 }
 
-static int buffer_flush(struct smack_file_buffer *buf)
+static inline int label_char_valid(char c)
 {
-	int pos;
-	int ret;
-
-	/* Write buffered bytes to kernel, up to flush_pos */
-	for (pos = 0; pos < buf->flush_pos; ) {
-		ret = write(buf->fd, buf->buf + pos, buf->flush_pos - pos);
-		if (ret == -1) {
-			if (errno != EINTR)
-				return -1;
-		} else
-			pos += ret;
+	if (c <= ' ' || c > '~')
+		return 0;
+
+	switch (c) {
+	case '/':
+	case '"':
+	case '\\':
+	case '\'':
+		return 0;
+	default:
+		return 1;
 	}
+}
+
+/*
+ * Returns the number of valid label characters at the start of src,
+ * looking at no more than SMACK_LABEL_LEN + 1 of them and never past end.
+ * The hash of the scanned characters is stored to hash.
+ */
+static inline int label_scan(const char *src, const char *end, uint32_t *hash)
+{
+	const char *p;
+	uint32_t h = *hash;
+
+	for (p = src; p < end && label_char_valid(*p); ++p)
+		/* This efficient hash function,
+		 * created by Daniel J. Bernstein,
+		 * is known as DJB2 algorithm */
+		h = (h << 5) + h + *p;
+
+	*hash = h;
+	return p - src;
+}
+
+static int label_span_scalar(const char *src, const char *end, uint32_t *hash)
+{
+	if (end - src > SMACK_LABEL_LEN + 1)
+		end = src + SMACK_LABEL_LEN + 1;
+
+	*hash = 5381;/*DJB2 hashing function magic number*/
+	return label_scan(src, end, hash);
+}
+
+#ifdef HAVE_LABEL_SPAN_SIMD
+
+static inline uint32_t invalid_label_mask_sse2(__m128i v)
+	__attribute__((target("sse2")));
+static inline uint32_t invalid_label_mask_sse2(__m128i v)
+{
+	__m128i valid;
+	__m128i special;
+
+	/* Signed compares also reject the bytes 0x80 - 0xff */
+	valid = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ')),
+			      _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+	special = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+			     _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')),
+			     _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))));
+
+	return ~_mm_movemask_epi8(_mm_andnot_si128(special, valid)) & 0xffff;
+}
+
+/*
+ * Returns the invalid byte mask of the left (1 to 15) bytes at p, with
+ * all bits from left up set. Only bytes in [p, p + left) are loaded: the
+ * range is covered by two overlapping loads, one from its start and one
+ * ending at its end.
+ */
+static inline uint32_t invalid_label_mask_tail(const char *p, int left)
+	__attribute__((target("sse2")));
+static inline uint32_t invalid_label_mask_tail(const char *p, int left)
+{
+	uint32_t mask = ~0U << left;
+	uint64_t lo64, hi64;
+	uint32_t lo32, hi32;
+	uint32_t m;
+	int i;
 
-	/* Move remaining, not flushed bytes to the buffer start */
-	memcpy(buf->buf, buf->buf + pos, buf->pos - pos);
-	buf->pos -= pos;
-	buf->flush_pos = 0;
+	if (left >= 8) {
+		memcpy(&lo64, p, 8);
+		memcpy(&hi64, p + left - 8, 8);
+		m = invalid_label_mask_sse2(_mm_set_epi64x(hi64, lo64));
+		return mask | (m & 0xff) | (m >> 8) << (left - 8);
+	}
+	if (left >= 4) {
+		memcpy(&lo32, p, 4);
+		memcpy(&hi32, p + left - 4, 4);
+		m = invalid_label_mask_sse2(_mm_set_epi32(0, 0, hi32, lo32));
+		return mask | (m & 0xf) | (m >> 4 & 0xf) << (left - 4);
+	}
 
-	return 0;
+	for (i = 0; i < left; ++i)
+		if (!label_char_valid(p[i]))
+			mask |= 1U << i;
+	return mask;
 }
 
-static inline int rule_print_long(struct smack_file_buffer *buffer,
-	struct smack_label *subject_label, struct smack_label *object_label,
-	const char *allow_str, const char *deny_str)
+/*
+ * Classifies 16 bytes at a time. SSE2 has no 32 bit multiply, so the
+ * hash is computed over each block with scalar code right after it has
+ * been classified. Nothing is loaded past end, a last partial block is
+ * classified by invalid_label_mask_tail().
+ */
+static int label_span_sse2(const char *src, const char *end, uint32_t *hash)
+	__attribute__((target("sse2")));
+static int label_span_sse2(const char *src, const char *end, uint32_t *hash)
 {
-	if (buffer->pos + subject_label->len + 1 + object_label->len + 1 + ACC_LEN >= buffer->size)
-		return -1;
+	const char *p = src;
+	uint32_t h = 5381;
+	uint32_t mask;
+	int left;
+	int n;
+	int i;
 
-	memcpy(buffer->buf + buffer->pos, subject_label->label, subject_label->len);
-	buffer->pos += subject_label->len;
-	buffer->buf[buffer->pos++] = ' ';
-	memcpy(buffer->buf + buffer->pos, object_label->label, object_label->len);
-	buffer->pos += object_label->len;
-	buffer->buf[buffer->pos++] = ' ';
-	memcpy(buffer->buf + buffer->pos, allow_str, ACC_LEN);
-	buffer->pos += ACC_LEN;
-	if (deny_str != NULL) {
-		if (buffer->pos + 1 + ACC_LEN >= buffer->size)
-			return -1;
-		buffer->buf[buffer->pos++] = ' ';
-		memcpy(buffer->buf + buffer->pos, deny_str, ACC_LEN);
-		buffer->pos += ACC_LEN;
+	if (end - src > SMACK_LABEL_LEN + 1)
+		end = src + SMACK_LABEL_LEN + 1;
+
+	while (p < end) {
+		left = end - p;
+		if (left < 16)
+			mask = invalid_label_mask_tail(p, left);
+		else
+			mask = invalid_label_mask_sse2(
+				_mm_loadu_si128((const __m128i *) p));
+		n = mask ? __builtin_ctz(mask) : 16;
+
+		for (i = 0; i < n; ++i)
+			h = (h << 5) + h + p[i];
+		p += n;
+		if (n < 16)
+			break;
 	}
 
-	return 0;
+	*hash = h;
+	return p - src;
 }
 
-static inline int rule_print_short(struct smack_file_buffer *buffer,
-	struct smack_label *subject_label, struct smack_label *object_label,
-	const char *access_str)
+/* Powers of 33 for hashing a block of up to 32 bytes at once:
+ * djb2_block_coef[32 - n + i] is the weight of byte i in an n byte block,
+ * which is 33^(n - 1 - i), and zero for bytes past the block. */
+static uint32_t djb2_block_coef[64] __attribute__((aligned(32)));
+static uint32_t djb2_pow[33];
+
+static void djb2_init_tables(void)
 {
-	int ret = snprintf(buffer->buf + buffer->pos, buffer->size - buffer->pos,
-		KERNEL_SHORT_FORMAT, subject_label->label, object_label->label, access_str);
-	if (ret < 0 || ret + buffer->pos >= buffer->size)
-		return -1;
+	uint32_t pow = 1;
+	int i;
 
-	return 0;
+	for (i = 0; i <= 32; ++i) {
+		djb2_pow[i] = pow;
+		if (i < 32)
+			djb2_block_coef[31 - i] = pow;
+		pow *= 33;
+	}
 }
 
-static int accesses_print(struct smack_accesses *handle, int clear,
-			  int use_long, int multiline,
-			  struct smack_file_buffer *load_buffer,
-			  struct smack_file_buffer *change_buffer)
+static inline uint32_t invalid_label_mask_avx2(__m256i v)
+	__attribute__((target("avx2")));
+static inline uint32_t invalid_label_mask_avx2(__m256i v)
 {
-	struct smack_file_buffer *buffer;
-	char allow_str[ACC_LEN + 1];
-	char deny_str[ACC_LEN + 1];
-	struct smack_label *subject_label;
-	struct smack_label *object_label;
-	struct smack_rule *rule;
-	union smack_perm *perm;
-	int merge_cnt;
-	int x;
-	int y;
+	__m256i valid;
+	__m256i special;
+
+	valid = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(' ')),
+				 _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+	special = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')),
+				_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''))));
+
+	return ~(uint32_t) _mm256_movemask_epi8(_mm256_andnot_si256(special, valid));
+}
 
-	if (!use_long && handle->has_long)
-		return -1;
+/*
+ * Classifies 32 bytes at a time and folds the valid bytes of each block
+ * into the DJB2 hash with one multiply-add per byte lane:
+ * h' = h * 33^n + sum(byte[i] * 33^(n - 1 - i)).
+ * A last partial block is classified from two overlapping 16 byte loads,
+ * or by invalid_label_mask_tail(), and hashed with scalar code.
+ */
+static int label_span_avx2(const char *src, const char *end, uint32_t *hash)
+	__attribute__((target("avx2")));
+static int label_span_avx2(const char *src, const char *end, uint32_t *hash)
+{
+	const char *p = src;
+	const uint32_t *coef;
+	uint32_t h = 5381;
+	uint32_t mask;
+	__m256i v;
+	__m256i sum;
+	__m128i sum128;
+	int left;
+	int n;
+	int i;
 
-	load_buffer->pos = 0;
-	change_buffer->pos = 0;
-	bzero(handle->merge_perms, handle->labels_cnt * sizeof(union smack_perm));
-	for (x = 0; x < handle->labels_cnt; ++x) {
-		subject_label = handle->labels[x];
-		merge_cnt = 0;
-		for (rule = subject_label->first_rule; rule != NULL; rule = rule->next_rule) {
-			perm = &(handle->merge_perms[rule->object_id]);
-			if (perm->allow_deny_code == 0)
-				handle->merge_object_ids[merge_cnt++] = rule->object_id;
-
-			if (clear) {
-				perm->allow_code = 0;
-				perm->deny_code  = ACCESS_TYPE_ALL;
-			} else {
-				perm->allow_code |=  rule->perm.allow_code;
-				perm->allow_code &= ~rule->perm.deny_code;
-				perm->deny_code  &= ~rule->perm.allow_code;
-				perm->deny_code  |=  rule->perm.deny_code;
-			}
+	if (end - src > SMACK_LABEL_LEN + 1)
+		end = src + SMACK_LABEL_LEN + 1;
+
+	while (p < end) {
+		left = end - p;
+		if (left < 32) {
+			if (left < 16)
+				mask = invalid_label_mask_tail(p, left);
+			else
+				mask = ~0U << left |
+					invalid_label_mask_sse2(_mm_loadu_si128(
+						(const __m128i *) p)) |
+					invalid_label_mask_sse2(_mm_loadu_si128(
+						(const __m128i *) (end - 16))) <<
+					(left - 16);
+			n = __builtin_ctz(mask);
+			for (i = 0; i < n; ++i)
+				h = (h << 5) + h + p[i];
+			p += n;
+			break;
 		}
 
-		for (y = 0; y < merge_cnt; ++y) {
-			int ret = 0;
-			object_label = handle->labels[handle->merge_object_ids[y]];
-			perm = &(handle->merge_perms[object_label->id]);
-			access_code_to_str(perm->allow_code, allow_str);
-
-			if ((perm->allow_code | perm->deny_code) != ACCESS_TYPE_ALL) {
-				/* Fail immediately without doing any further processing
-				   if modify rules are not supported. */
-				if (change_buffer->fd < 0)
-					return -1;
-
-				buffer = change_buffer;
-				buffer->flush_pos = buffer->pos;
-				access_code_to_str(perm->deny_code, deny_str);
-				ret = rule_print_long(buffer,
-					subject_label, object_label, allow_str, deny_str);
-			} else {
-				buffer = load_buffer;
-				buffer->flush_pos = buffer->pos;
-				if (use_long)
-					ret = rule_print_long(buffer,
-						subject_label, object_label, allow_str, NULL);
-				else
-					ret = rule_print_short(buffer,
-						subject_label, object_label, allow_str);
-			}
+		v = _mm256_loadu_si256((const __m256i *) p);
+		mask = invalid_label_mask_avx2(v);
+		n = mask ? __builtin_ctz(mask) : 32;
+
+		coef = djb2_block_coef + 32 - n;
+		sum = _mm256_mullo_epi32(
+			_mm256_cvtepu8_epi32(_mm256_castsi256_si128(v)),
+			_mm256_loadu_si256((const __m256i *) coef));
+		sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(
+			_mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_castsi256_si128(v), 8)),
+			_mm256_loadu_si256((const __m256i *) (coef + 8))));
+		sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(
+			_mm256_cvtepu8_epi32(_mm256_extracti128_si256(v, 1)),
+			_mm256_loadu_si256((const __m256i *) (coef + 16))));
+		sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(
+			_mm256_cvtepu8_epi32(_mm_srli_si128(_mm256_extracti128_si256(v, 1), 8)),
+			_mm256_loadu_si256((const __m256i *) (coef + 24))));
+
+		sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum),
+				       _mm256_extracti128_si256(sum, 1));
+		sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4e));
+		sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xb1));
+		h = h * djb2_pow[n] + (uint32_t) _mm_cvtsi128_si32(sum128);
+
+		p += n;
+		if (n < 32)
+			break;
+	}
 
-			if (ret)
-				return ret;
-			perm->allow_deny_code = 0;
+	*hash = h;
+	return p - src;
+}
 
-			if (multiline) {
-				buffer->buf[buffer->pos++] = '\n';
-				if (buffer->pos >= handle->page_size)
-					if (buffer_flush(buffer))
-						return -1;
-			} else {
-				/* When no multi-line is supported, just flush
-				 * the rule that was just generated */
-				buffer->flush_pos = buffer->pos;
-				if (buffer_flush(buffer))
-					return -1;
-			}
-		}
-	}
+#endif /* HAVE_LABEL_SPAN_SIMD */
 
-	if (load_buffer->pos > 0) {
-		load_buffer->flush_pos = load_buffer->pos;
-		if (buffer_flush(load_buffer))
-			return -1;
-	}
-	if (change_buffer->pos > 0) {
-		change_buffer->flush_pos = change_buffer->pos;
-		if (buffer_flush(change_buffer))
-			return -1;
+static void init_label_span(void) __attribute__ ((constructor));
+static void init_label_span(void)
+{
+#ifdef HAVE_LABEL_SPAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		djb2_init_tables();
+		label_span = label_span_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		label_span = label_span_sse2;
 	}
-
-	return 0;
+#endif
 }
 
-static inline ssize_t get_label(char *dest, const char *src, unsigned int *hash)
+static inline ssize_t get_label(char *dest, const char *src, uint32_t *hash)
 {
-	int i;
-	unsigned int h = 5381;/*DJB2 hashing function magic number*/;
+	uint32_t h;
+	int len;
 
 	if (!src || src[0] == '\0' || src[0] == '-')
 		return -1;
 
-	for (i = 0; i < (SMACK_LABEL_LEN + 1) && src[i]; i++) {
-		if (src[i] <= ' ' || src[i] > '~')
-			return -1;
-		switch (src[i]) {
-		case '/':
-		case '"':
-		case '\\':
-		case '\'':
-			return -1;
-		default:
-			break;
-		}
-
-		if (dest)
-			dest[i] = src[i];
-		if (hash)
-			/* This efficient hash function,
-			 * created by Daniel J. Bernstein,
-			 * is known as DJB2 algorithm */
-			h = (h << 5) + h + src[i];
-	}
+	/* The scan must not look past the terminator */
+	len = label_span(src, src + strnlen(src, SMACK_LABEL_LEN + 1), &h);
+	if (len > SMACK_LABEL_LEN || src[len] != '\0')
+		return -1;
 
-	if (dest && i < (SMACK_LABEL_LEN + 1))
-		dest[i] = '\0';
+	if (dest)
+		memcpy(dest, src, len + 1);
 	if (hash)
-		*hash = h % DICT_HASH_SIZE;
+		*hash = h;
 
-	return i < (SMACK_LABEL_LEN + 1) ? i : -1;
+	return len;
 }
 
-
 static inline int str_to_access_code(const char *str)
 {
 	int i;
 	unsigned int code = 0;
+	uint8_t type;
 
 	for (i = 0; str[i] != '\0'; i++) {
-		switch (str[i]) {
-		case 'r':
-		case 'R':
-			code |= ACCESS_TYPE_R;
-			break;
-		case 'w':
-		case 'W':
-			code |= ACCESS_TYPE_W;
-			break;
-		case 'x':
-		case 'X':
-			code |= ACCESS_TYPE_X;
-			break;
-		case 'a':
-		case 'A':
-			code |= ACCESS_TYPE_A;
-			break;
-		case 't':
-		case 'T':
-			code |= ACCESS_TYPE_T;
-			break;
-		case 'l':
-		case 'L':
-			code |= ACCESS_TYPE_L;
-			break;
-		case '-':
-			break;
-		default:
+		type = access_type_table[(unsigned char) str[i]];
+		if (type == 0)
 			return -1;
-		}
+		code |= type;
 	}
 
-	return code;
+	return code & ACCESS_TYPE_ALL;
+}
+
+static void init_access_strs(void) __attribute__ ((constructor));
+static void init_access_strs(void)
+{
+	static const char letters[] = "rwxatl";
+	unsigned int code;
+	int i;
+
+	for (code = 0; code <= ACCESS_TYPE_ALL; ++code) {
+		for (i = 0; i < ACC_LEN; ++i)
+			access_strs[code][i] = (code & (1 << i)) ?
+				letters[i] : '-';
+		access_strs[code][ACC_LEN] = '\0';
+	}
+}
+
+static inline uint32_t dict_home(struct smack_accesses *handle, uint32_t hash)
+{
+	/* DJB2 has weak low bits, use the top bits of a Fibonacci product */
+	return (hash * DICT_GOLDEN) >> handle->dict_shift;
+}
+
+/* Returns the id of the label, or -1 if the handle does not know it */
+static inline int is_label_known(struct smack_accesses *handle,
+				 const char *label, int len, uint32_t hash)
+{
+	struct smack_dict_slot *slot;
+	uint32_t mask = handle->dict_size - 1;
+	uint32_t pos = dict_home(handle, hash);
+	uint32_t dist;
+
+	for (dist = 0; ; ++dist, pos = (pos + 1) & mask) {
+		slot = &handle->dict[pos];
+		if (slot->id < 0)
+			return -1;
+		/* Robin Hood invariant: the label would have displaced
+		 * any entry that sits closer to its home slot */
+		if (((pos - dict_home(handle, slot->hash)) & mask) < dist)
+			return -1;
+		if (slot->hash == hash && slot->len == len &&
+		    memcmp(label_str(handle, slot->id), label, len) == 0)
+			return slot->id;
+	}
 }
 
-static inline void access_code_to_str(unsigned int code, char *str)
+static void dict_insert(struct smack_accesses *handle, uint32_t hash,
+			int len, int id)
 {
-	str[0] = ((code & ACCESS_TYPE_R) != 0) ? 'r' : '-';
-	str[1] = ((code & ACCESS_TYPE_W) != 0) ? 'w' : '-';
-	str[2] = ((code & ACCESS_TYPE_X) != 0) ? 'x' : '-';
-	str[3] = ((code & ACCESS_TYPE_A) != 0) ? 'a' : '-';
-	str[4] = ((code & ACCESS_TYPE_T) != 0) ? 't' : '-';
-	str[5] = ((code & ACCESS_TYPE_L) != 0) ? 'l' : '-';
-	str[6] = '\0';
+	struct smack_dict_slot entry = {.hash = hash, .len = len, .id = id};
+	struct smack_dict_slot tmp;
+	uint32_t mask = handle->dict_size - 1;
+	uint32_t pos = dict_home(handle, hash);
+	uint32_t dist = 0;
+	uint32_t slot_dist;
+
+	for (;;) {
+		if (handle->dict[pos].id < 0) {
+			handle->dict[pos] = entry;
+			return;
+		}
+
+		slot_dist = (pos - dict_home(handle, handle->dict[pos].hash)) & mask;
+		if (slot_dist < dist) {
+			tmp = handle->dict[pos];
+			handle->dict[pos] = entry;
+			entry = tmp;
+			dist = slot_dist;
+		}
+
+		pos = (pos + 1) & mask;
+		++dist;
+	}
 }
 
-static inline struct smack_label *
-is_label_known(struct smack_accesses *handle, const char *label, int hash)
+static int dict_resize(struct smack_accesses *handle, uint32_t size)
 {
-	struct smack_label *lab = handle->label_hash[hash].first;
-	while (lab != NULL && strcmp(label, lab->label) != 0)
-		lab = lab->next_label;
-	return lab;
+	struct smack_dict_slot *old_dict = handle->dict;
+	uint32_t old_size = handle->dict_size;
+	uint32_t i;
+	int shift = 32;
+
+	handle->dict = malloc(size * sizeof(struct smack_dict_slot));
+	if (handle->dict == NULL) {
+		handle->dict = old_dict;
+		return -1;
+	}
+
+	for (i = 0; i < size; ++i)
+		handle->dict[i].id = -1;
+	for (i = size; i > 1; i >>= 1)
+		--shift;
+	handle->dict_size = size;
+	handle->dict_shift = shift;
+
+	for (i = 0; i < old_size; ++i)
+		if (old_dict[i].id >= 0)
+			dict_insert(handle, old_dict[i].hash, old_dict[i].len,
+				    old_dict[i].id);
+
+	free(old_dict);
+	return 0;
 }
 
 static inline int accesses_resize(struct smack_accesses *handle)
 {
-	struct smack_label **labels;
+	struct smack_label *labels;
 	union smack_perm *merge_perms;
 	int *merge_object_ids;
 	int alloc = handle->labels_alloc << 1;
 
-	labels = realloc(handle->labels, alloc * sizeof(struct smack_label *));
+	labels = realloc(handle->labels, alloc * sizeof(struct smack_label));
 	if (labels == NULL)
 		return -1;
 	handle->labels = labels;
@@ -1217,83 +4098,520 @@ static inline int accesses_resize(struct smack_accesses *handle)
 	return 0;
 }
 
-static struct smack_label *label_add(struct smack_accesses *handle, const char *label)
+/* Makes room for size more bytes in the label pool */
+static int label_pool_reserve(struct smack_accesses *handle, uint32_t size)
 {
-	struct smack_hash_entry *hash_entry;
-	unsigned int hash_value = 0;
-	struct smack_label *new_label;
+	uint64_t alloc = handle->label_pool_alloc ?
+		handle->label_pool_alloc : LABEL_POOL_MIN_SIZE;
+	char *pool;
+
+	if ((uint64_t) handle->label_pool_size + size <= handle->label_pool_alloc)
+		return 0;
+
+	while (alloc < (uint64_t) handle->label_pool_size + size)
+		alloc <<= 1;
+	if (alloc > UINT32_MAX)
+		return -1;
+
+	pool = realloc(handle->label_pool, alloc);
+	if (pool == NULL)
+		return -1;
+
+	handle->label_pool = pool;
+	handle->label_pool_alloc = alloc;
+	return 0;
+}
+
+static int label_add(struct smack_accesses *handle, const char *label)
+{
+	uint32_t hash_value = 0;
 	int len;
 
 	len = get_label(NULL, label, &hash_value);
 	if (len == -1)
-		return NULL;
+		return -1;
+
+	return label_add_span(handle, label, len, hash_value);
+}
+
+/*
+ * Adds a label that has already been validated and returns its id. The
+ * label does not need to be null terminated, but must not point into the
+ * label pool of the handle.
+ */
+static int label_add_span(struct smack_accesses *handle, const char *label,
+			  int len, uint32_t hash_value)
+{
+	struct smack_label *new_label;
+	int id;
 
-	new_label = is_label_known(handle, label, hash_value);
-	if (new_label == NULL) {/*no entry added yet*/
+	id = is_label_known(handle, label, len, hash_value);
+	if (id < 0) {/*no entry added yet*/
 		if (handle->labels_cnt == handle->labels_alloc)
 			if (accesses_resize(handle))
-				return NULL;
+				return -1;
 
-		new_label = malloc(sizeof(struct smack_label));
-		if (new_label == NULL)
-			return NULL;
-		new_label->label = malloc(len + 1);
-		if (new_label->label == NULL) {
-			free(new_label);
-			return NULL;
-		}
+		/* Keep the load factor of the dictionary below 3/4 */
+		if ((uint32_t) (handle->labels_cnt + 1) * 4 > handle->dict_size * 3)
+			if (dict_resize(handle, handle->dict_size << 1))
+				return -1;
 
-		memcpy(new_label->label, label, len + 1);
-		new_label->id = handle->labels_cnt;
+		if (label_pool_reserve(handle, len + 1))
+			return -1;
+
+		id = handle->labels_cnt++;
+		new_label = &handle->labels[id];
+		new_label->offset = handle->label_pool_size;
 		new_label->len = len;
-		new_label->first_rule = NULL;
-		new_label->last_rule = NULL;
-		new_label->next_label = NULL;
-		hash_entry = &(handle->label_hash[hash_value]);
-		if (hash_entry->first == NULL) {
-			hash_entry->first = new_label;
-			hash_entry->last = new_label;
-		} else {
-			hash_entry->last->next_label = new_label;
-			hash_entry->last = new_label;
+		memcpy(handle->label_pool + new_label->offset, label, len);
+		handle->label_pool[new_label->offset + len] = '\0';
+		handle->label_pool_size += len + 1;
+		dict_insert(handle, hash_value, len, id);
+	}
+
+	return id;
+}
+
+/*
+ * Sorts the rules added since the last call into the rule table. A fold
+ * index that has been built is kept up to date.
+ */
+static int accesses_finalize(struct smack_accesses *handle)
+{
+	struct smack_fold_slot *slot;
+	struct smack_new_rule *new_rule;
+	struct smack_rule *rules;
+	uint32_t *rules_start;
+	uint32_t *pos;
+	uint32_t cnt;
+	uint32_t i;
+	int remap;
+	int x;
+
+	if (handle->new_rules_cnt == 0 &&
+	    handle->rules_labels_cnt == handle->labels_cnt)
+		return 0;
+
+	__atomic_store_n(&handle->pairs_ready, 0, __ATOMIC_RELAXED);
+
+	rules_start = malloc((handle->labels_cnt + 1) * sizeof(uint32_t));
+	if (rules_start == NULL)
+		return -1;
+	pos = calloc(handle->labels_cnt + 1, sizeof(uint32_t));
+	if (pos == NULL) {
+		free(rules_start);
+		return -1;
+	}
+	rules = malloc((handle->rules_cnt + handle->new_rules_cnt) *
+		       sizeof(struct smack_rule) + 1);
+	if (rules == NULL) {
+		free(pos);
+		free(rules_start);
+		return -1;
+	}
+
+	/* Counting sort by subject id. Rules already in the table come
+	 * before the new ones so that the order of addition is kept. */
+	for (x = 0; x < handle->rules_labels_cnt; ++x)
+		pos[x] = handle->rules_start[x + 1] - handle->rules_start[x];
+	for (i = 0; i < handle->new_rules_cnt; ++i)
+		++pos[handle->new_rules[i].subject_id];
+
+	for (x = 0, cnt = 0; x < handle->labels_cnt; ++x) {
+		rules_start[x] = cnt;
+		cnt += pos[x];
+		pos[x] = rules_start[x];
+	}
+	rules_start[x] = cnt;
+
+	for (x = 0; x < handle->rules_labels_cnt; ++x) {
+		cnt = handle->rules_start[x + 1] - handle->rules_start[x];
+		memcpy(rules + pos[x], handle->rules + handle->rules_start[x],
+		       cnt * sizeof(struct smack_rule));
+		pos[x] += cnt;
+	}
+
+	/* Only the fold index of a new rule changes, to the place it gets
+	 * among the rules of its subject */
+	remap = handle->folds_ready && handle->folds != NULL;
+	for (i = 0; i < handle->new_rules_cnt; ++i) {
+		new_rule = &handle->new_rules[i];
+		x = new_rule->subject_id;
+		if (remap) {
+			slot = fold_find(handle, x, new_rule->rule.object_id);
+			if (slot->index == (i | FOLD_NEW))
+				slot->index = pos[x] - rules_start[x];
 		}
-		handle->labels[handle->labels_cnt++] = new_label;
+		rules[pos[x]++] = new_rule->rule;
 	}
 
-	return new_label;
+	free(pos);
+	free(handle->rules);
+	free(handle->rules_start);
+	free(handle->new_rules);
+	handle->rules = rules;
+	handle->rules_start = rules_start;
+	handle->rules_cnt = rules_start[handle->labels_cnt];
+	handle->rules_labels_cnt = handle->labels_cnt;
+	handle->new_rules = NULL;
+	handle->new_rules_cnt = 0;
+	handle->new_rules_alloc = 0;
+	return 0;
 }
 
-int smack_load_policy(void)
+/*
+ * Returns roughly the memory that the rules of the handle hold, including
+ * what accesses_finalize() will allocate for the rules added so far. This
+ * is what accesses_reset() gives back.
+ */
+static size_t accesses_rules_memory(struct smack_accesses *handle)
+{
+	size_t size;
+
+	size = (size_t) handle->new_rules_cnt * sizeof(struct smack_new_rule);
+	size += ((size_t) handle->rules_cnt + handle->new_rules_cnt) *
+		sizeof(struct smack_rule);
+	size += (size_t) (handle->labels_cnt + 1) * 2 * sizeof(uint32_t);
+	if (handle->folds != NULL)
+		size += ((size_t) handle->folds_mask + 1) *
+			sizeof(struct smack_fold_slot);
+	if (handle->pairs != NULL)
+		size += ((size_t) handle->pairs_mask + 1) *
+			sizeof(struct smack_pair_slot);
+
+	return size;
+}
+
+/*
+ * Drops all labels and rules of the handle. The label arrays, the
+ * dictionary and the label pool are kept for reuse.
+ */
+static void accesses_reset(struct smack_accesses *handle)
+{
+	uint32_t i;
+
+	for (i = 0; i < handle->dict_size; ++i)
+		handle->dict[i].id = -1;
+	handle->labels_cnt = 0;
+	handle->label_pool_size = 0;
+	handle->has_long = 0;
+
+	free(handle->rules);
+	free(handle->rules_start);
+	handle->rules = NULL;
+	handle->rules_start = NULL;
+	handle->rules_cnt = 0;
+	handle->rules_labels_cnt = 0;
+	handle->new_rules_cnt = 0;
+
+	free(handle->pairs);
+	handle->pairs = NULL;
+	handle->pairs_mask = 0;
+	__atomic_store_n(&handle->pairs_ready, 0, __ATOMIC_RELAXED);
+	free(handle->folds);
+	handle->folds = NULL;
+	handle->folds_cnt = 0;
+	handle->folds_mask = 0;
+	handle->folds_ready = 0;
+}
+
+/*
+ * Builds the (subject, object) index of the merged rules. Called with
+ * pairs_lock held.
+ */
+static int pairs_build(struct smack_accesses *handle)
+{
+	struct smack_pair_slot *pairs;
+	struct smack_pair_slot *slot;
+	uint64_t key;
+	uint32_t size = PAIRS_MIN_SIZE;
+	uint32_t pos;
+	int merge_cnt;
+	int object_id;
+	int x;
+	int y;
+
+	if (accesses_finalize(handle))
+		return -1;
+
+	/* There are at most as many pairs as rules, keep the load below 3/4 */
+	while ((uint64_t) handle->rules_cnt * 4 > (uint64_t) size * 3) {
+		if (size == 1U << 31)
+			return -1;
+		size <<= 1;
+	}
+
+	pairs = malloc(size * sizeof(struct smack_pair_slot));
+	if (pairs == NULL)
+		return -1;
+	for (pos = 0; pos < size; ++pos)
+		pairs[pos].subject_id = PAIR_EMPTY;
+
+	bzero(handle->merge_perms, handle->labels_cnt * sizeof(union smack_perm));
+	for (x = 0; x < handle->labels_cnt; ++x) {
+		merge_cnt = subject_merge(handle, x, 0);
+		for (y = 0; y < merge_cnt; ++y) {
+			object_id = handle->merge_object_ids[y];
+			key = (uint64_t) x << 32 | object_id;
+			pos = (key * PAIRS_GOLDEN) >> 32 & (size - 1);
+			while (pairs[pos].subject_id != PAIR_EMPTY)
+				pos = (pos + 1) & (size - 1);
+			slot = &pairs[pos];
+			slot->subject_id = x;
+			slot->object_id = object_id;
+			slot->allow_code = handle->merge_perms[object_id].allow_code;
+			handle->merge_perms[object_id].allow_deny_code = 0;
+		}
+	}
+
+	free(handle->pairs);
+	handle->pairs = pairs;
+	handle->pairs_mask = size - 1;
+	__atomic_store_n(&handle->pairs_ready, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Appends the rules of src to dst. Labels of src are looked up or added
+ * in dst in src id order, so that dst ends up as if the input of src had
+ * been added to it directly.
+ */
+static int accesses_merge(struct smack_accesses *dst,
+			  struct smack_accesses *src)
 {
-	if (!smack_smackfs_path()) {
-		fprintf(stderr, "SmackFS is not mounted.\n");
+	struct smack_new_rule *new_rules;
+	struct smack_new_rule *new_rule;
+	struct smack_rule *rule;
+	const char *label;
+	uint32_t *map;
+	uint32_t hash;
+	uint32_t alloc;
+	uint32_t i;
+	int id;
+	int x;
+
+	if (accesses_finalize(src))
+		return -1;
+
+	map = malloc(src->labels_cnt * sizeof(uint32_t) + 1);
+	if (map == NULL)
 		return -1;
+
+	for (x = 0; x < src->labels_cnt; ++x) {
+		label = label_str(src, x);
+		label_span(label, label + src->labels[x].len, &hash);
+		id = label_add_span(dst, label, src->labels[x].len, hash);
+		if (id < 0) {
+			free(map);
+			return -1;
+		}
+		map[x] = id;
+	}
+
+	/* With collapsing the rules are only as many as the new pairs */
+	if (dst->collapse) {
+		for (x = 0; x < src->labels_cnt; ++x)
+			for (i = src->rules_start[x]; i < src->rules_start[x + 1]; ++i)
+				if (rule_append(dst, map[x],
+						map[src->rules[i].object_id],
+						src->rules[i].perm)) {
+					free(map);
+					return -1;
+				}
+		goto out;
+	}
+
+	if (dst->new_rules_alloc - dst->new_rules_cnt < src->rules_cnt) {
+		alloc = dst->new_rules_cnt + src->rules_cnt;
+		new_rules = realloc(dst->new_rules,
+				    alloc * sizeof(struct smack_new_rule));
+		if (new_rules == NULL) {
+			free(map);
+			return -1;
+		}
+		dst->new_rules = new_rules;
+		dst->new_rules_alloc = alloc;
+	}
+
+	for (x = 0; x < src->labels_cnt; ++x) {
+		for (i = src->rules_start[x]; i < src->rules_start[x + 1]; ++i) {
+			rule = &src->rules[i];
+			new_rule = &dst->new_rules[dst->new_rules_cnt++];
+			new_rule->subject_id = map[x];
+			new_rule->rule.object_id = map[rule->object_id];
+			new_rule->rule.perm = rule->perm;
+		}
 	}
 
-	if (clear())
+out:
+	dst->has_long |= src->has_long;
+	free(map);
+	return 0;
+}
+
+/*
+ * Fills an empty handle from a compiled policy image. The image is checked
+ * for consistency before the handle is touched, the labels themselves are
+ * taken as they are.
+ */
+static int accesses_load_image(struct smack_accesses *handle,
+			       const char *image, size_t size)
+{
+	const struct smack_compiled_header *header;
+	const struct smack_compiled_label *records;
+	const struct smack_rule *image_rules;
+	const uint32_t *image_rules_start;
+	const char *strings;
+	struct smack_rule *rules;
+	uint32_t *rules_start;
+	char *pool;
+	uint64_t expected;
+	uint32_t dict_size = DICT_MIN_SIZE;
+	uint32_t labels_cnt;
+	uint32_t i;
+
+	header = (const struct smack_compiled_header *) image;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) ||
+	    header->version != COMPILED_VERSION ||
+	    header->byte_order != COMPILED_BYTE_ORDER ||
+	    header->labels_cnt > INT32_MAX / 2)
 		return -1;
 
-	if (apply_rules(ACCESSES_D_PATH, 0))
+	labels_cnt = header->labels_cnt;
+	expected = sizeof(*header) +
+		   (uint64_t) labels_cnt * sizeof(struct smack_compiled_label) +
+		   (labels_cnt + 1ULL) * sizeof(uint32_t) +
+		   (uint64_t) header->rules_cnt * sizeof(struct smack_rule) +
+		   header->strings_size;
+	if (size != expected ||
+	    crc32_update(0, header + 1, size - sizeof(*header)) != header->crc)
 		return -1;
 
-	if (apply_cipso(CIPSO_D_PATH))
+	records = (const struct smack_compiled_label *) (header + 1);
+	image_rules_start = (const uint32_t *) (records + labels_cnt);
+	image_rules = (const struct smack_rule *) (image_rules_start +
+						   labels_cnt + 1);
+	strings = (const char *) (image_rules + header->rules_cnt);
+
+	for (i = 0; i < labels_cnt; ++i)
+		if (records[i].len == 0 || records[i].len > SMACK_LABEL_LEN ||
+		    records[i].offset >= header->strings_size ||
+		    header->strings_size - records[i].offset <= records[i].len ||
+		    strings[records[i].offset + records[i].len] != '\0')
+			return -1;
+
+	if (image_rules_start[0] != 0 ||
+	    image_rules_start[labels_cnt] != header->rules_cnt)
 		return -1;
+	for (i = 0; i < labels_cnt; ++i)
+		if (image_rules_start[i] > image_rules_start[i + 1])
+			return -1;
+	for (i = 0; i < header->rules_cnt; ++i)
+		if (image_rules[i].object_id >= labels_cnt ||
+		    (image_rules[i].perm.allow_code |
+		     image_rules[i].perm.deny_code) & ~ACCESS_TYPE_ALL)
+			return -1;
 
+	/* Allocate everything up front, nothing can fail while filling in */
+	while ((uint32_t) handle->labels_alloc < labels_cnt)
+		if (accesses_resize(handle))
+			return -1;
+	while ((uint64_t) labels_cnt * 4 > (uint64_t) dict_size * 3)
+		dict_size <<= 1;
+	if (dict_size > handle->dict_size && dict_resize(handle, dict_size))
+		return -1;
 
-	int fd = open(ONLYCAP_PATH, O_RDONLY);
-	if (fd < 0) {
+	pool = malloc(header->strings_size + 1);
+	rules_start = malloc((labels_cnt + 1) * sizeof(uint32_t));
+	rules = malloc(header->rules_cnt * sizeof(struct smack_rule) + 1);
+	if (pool == NULL || rules_start == NULL || rules == NULL) {
+		free(rules);
+		free(rules_start);
+		free(pool);
 		return -1;
 	}
 
-	if (smack_set_onlycap_from_file(fd)) {
-		close(fd);
-		return -1;
+	/* The string table of the image becomes the label pool */
+	memcpy(pool, strings, header->strings_size);
+	free(handle->label_pool);
+	handle->label_pool = pool;
+	handle->label_pool_size = header->strings_size;
+	handle->label_pool_alloc = header->strings_size + 1;
+	for (i = 0; i < labels_cnt; ++i) {
+		handle->labels[i].offset = records[i].offset;
+		handle->labels[i].len = records[i].len;
+		dict_insert(handle, records[i].hash, records[i].len, i);
 	}
-	close(fd);
 
+	memcpy(rules_start, image_rules_start,
+	       (labels_cnt + 1) * sizeof(uint32_t));
+	memcpy(rules, image_rules, header->rules_cnt * sizeof(struct smack_rule));
+
+	free(handle->rules);
+	free(handle->rules_start);
+	handle->rules = rules;
+	handle->rules_start = rules_start;
+	handle->rules_cnt = header->rules_cnt;
+	handle->rules_labels_cnt = labels_cnt;
+	handle->labels_cnt = labels_cnt;
+	handle->has_long = header->has_long != 0;
+	__atomic_store_n(&handle->pairs_ready, 0, __ATOMIC_RELAXED);
+	handle->folds_ready = 0;
 	return 0;
 }
 
+static uint32_t crc32_table[4][256];
+
+static void init_crc32_table(void) __attribute__ ((constructor));
+static void init_crc32_table(void)
+{
+	uint32_t crc;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (0xedb88320U & -(crc & 1));
+		crc32_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 4; ++j)
+			crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^
+				crc32_table[0][crc32_table[j - 1][i] & 0xff];
+}
+
+/* CRC-32 (IEEE 802.3), four bytes at a time */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint32_t word;
+
+	crc = ~crc;
+	for (; size >= 4; size -= 4, p += 4) {
+		memcpy(&word, p, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap32(word);
+#endif
+		crc ^= word;
+		crc = crc32_table[3][crc & 0xff] ^
+		      crc32_table[2][(crc >> 8) & 0xff] ^
+		      crc32_table[1][(crc >> 16) & 0xff] ^
+		      crc32_table[0][crc >> 24];
+	}
+	for (; size > 0; --size, ++p)
+		crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p) & 0xff];
+
+	return ~crc;
+}
+
+int smack_load_policy(void)
+{
+	return load_policy(0, 0);
+}
+
 int smack_set_relabel_self(const char **labels, int cnt)
 {
 	int i;
@@ -1310,7 +4628,7 @@ int smack_set_relabel_self(const char **labels, int cnt)
 	if (buf == NULL)
 		return -1;
 
-	fd = openat(smackfs_mnt_dirfd, "relabel-self", O_WRONLY);
+	fd = smackfs_open("relabel-self", O_WRONLY);
 	if (fd < 0) {
 		ret = -1;
 		goto out;
@@ -1327,7 +4645,7 @@ int smack_set_relabel_self(const char **labels, int cnt)
 
 	}
 
-	if (write(fd, buf, size) < 0)
+	if (smackfs_write(fd, buf, size) < 0)
 		ret = -1;
 	else
 		ret = 0;
@@ -1351,7 +4669,7 @@ int smack_set_onlycap(const char **labels, int cnt)
 	if (init_smackfs_mnt())
 		return -1;
 
-	fd = openat(smackfs_mnt_dirfd, "onlycap", O_WRONLY);
+	fd = smackfs_open("onlycap", O_WRONLY);
 	if (fd < 0)
 		return -1;
 
@@ -1371,12 +4689,12 @@ int smack_set_onlycap(const char **labels, int cnt)
 			size += len;
 			buf[size++] = ' ';
 		}
-		if (write(fd, buf, size) < 0)
+		if (smackfs_write(fd, buf, size) < 0)
 			ret = -1;
 		else
 			ret = 0;
 	} else { /* emtpy list: reset onlycap */
-		if (write(fd, " ", 1) < 0)
+		if (smackfs_write(fd, " ", 1) < 0)
 			ret = -1;
 		else
 			ret = 0;
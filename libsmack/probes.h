@@ -0,0 +1,50 @@
+/*
+ * This file is part of libsmack.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static probes of the libsmack provider for perf and bpftrace, built with
+ * ./configure --enable-usdt. A probe site is a single nop and its arguments
+ * are only recorded in a note section, so enabled probes cost nothing
+ * until a tracer attaches. Without USDT support the macros expand to
+ * nothing and the arguments are not evaluated.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define SMACK_PROBE0(name) \
+	DTRACE_PROBE(libsmack, name)
+#define SMACK_PROBE1(name, a1) \
+	DTRACE_PROBE1(libsmack, name, a1)
+#define SMACK_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(libsmack, name, a1, a2)
+#define SMACK_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(libsmack, name, a1, a2, a3)
+#define SMACK_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(libsmack, name, a1, a2, a3, a4)
+#else
+#define SMACK_PROBE0(name) do { } while (0)
+#define SMACK_PROBE1(name, a1) do { } while (0)
+#define SMACK_PROBE2(name, a1, a2) do { } while (0)
+#define SMACK_PROBE3(name, a1, a2, a3) do { } while (0)
+#define SMACK_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#endif
+
+#endif // PROBES_H
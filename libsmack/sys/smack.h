@@ -44,6 +44,73 @@ struct smack_accesses;
  */
 struct smack_cipso;
 
+/*!
+ * Handle to the kernel interfaces used to apply rules and check access,
+ * kept open between calls.
+ */
+struct smack_session;
+
+/*!
+ * Access check for smack_have_access_batch(). The result is set to 1 if
+ * access is allowed, 0 if access is not allowed and negative on error.
+ */
+struct smack_access_query {
+	const char *subject;
+	const char *object;
+	const char *access_type;
+	int result;
+};
+
+/*!
+ * Counters of the access decision cache, see smack_access_cache_enable().
+ * hits and misses count the kernel questions that were answered from the
+ * cache or not, builtin counts the ones decided by the built-in rules.
+ */
+struct smack_access_cache_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long builtin;
+};
+
+/*!
+ * Statistics of a handle, see smack_accesses_get_stats(). The label and
+ * rule counts, memory and dictionary figures describe the handle as it is.
+ * parse_ns adds up the time spent in smack_accesses_add_from_file() and
+ * smack_accesses_add_from_files(). The remaining fields describe the last
+ * time the handle was applied, cleared or used as the new handle of a
+ * diff: the rules and bytes written to load2 (or load) and change-rule,
+ * the write() calls and the ones retried after EINTR, and where the time
+ * went. format_ns leaves out the time spent in merge_ns, in write() calls
+ * and waiting for the writer thread of a pipelined writer; write_ns is
+ * the time in write() calls of whichever thread made them.
+ *
+ * The caller sets size to sizeof(struct smack_accesses_stats) before the
+ * call, so that fields added in later versions are never written past
+ * the end of the structure it was built with.
+ */
+struct smack_accesses_stats {
+	size_t size;
+	unsigned int labels;
+	unsigned int long_labels;
+	unsigned long long rules;
+	unsigned long long merged_rules;
+	unsigned long long label_bytes;
+	unsigned long long rule_bytes;
+	unsigned int dict_size;
+	unsigned int dict_probe_max;
+	double dict_probe_avg;
+	unsigned long long load_rules;
+	unsigned long long load_bytes;
+	unsigned long long change_rules;
+	unsigned long long change_bytes;
+	unsigned long long writes;
+	unsigned long long write_retries;
+	unsigned long long parse_ns;
+	unsigned long long merge_ns;
+	unsigned long long format_ns;
+	unsigned long long write_ns;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,6 +125,18 @@ extern "C" {
  */
 int smack_accesses_new(struct smack_accesses **handle);
 
+/*!
+ * Allocates a new smack_accesses instance holding the access rules that
+ * are currently loaded in the kernel. The rules are read from the long
+ * label interface when the kernel has it and from the short one
+ * otherwise. The returned instance must be later freed with
+ * smack_accesses_free().
+ *
+ * @param handle output variable for the struct smack_accesses instance
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_new_from_kernel(struct smack_accesses **handle);
+
 /*!
  * Destroys a struct smack_accesses instance.
  *
@@ -83,6 +162,26 @@ int smack_accesses_save(struct smack_accesses *handle, int fd);
  */
 int smack_accesses_apply(struct smack_accesses *handle);
 
+/*!
+ * Write only the access rules that differ between two instances to the
+ * kernel. The result is the same as clearing the rules of old_handle with
+ * smack_accesses_clear() and applying new_handle, but pairs of subject and
+ * object whose access stays the same are not written and the kernel is
+ * never left without the rules. The rules of each pair are merged as
+ * smack_accesses_apply() does it, pairs that are new or whose access has
+ * changed are written as plain rules and pairs that exist only in
+ * old_handle are written with no access.
+ *
+ * old_handle should describe the rules currently in the kernel, for
+ * example the instance that was applied last.
+ *
+ * @param old_handle handle to the previously applied rules
+ * @param new_handle handle to the rules to apply
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_apply_diff(struct smack_accesses *old_handle,
+			      struct smack_accesses *new_handle);
+
 /*!
  * Clear access rules from the kernel. Clears the rules by writing
  * corresponding rules with zero access. Note that this function
@@ -136,6 +235,107 @@ int smack_accesses_add_modify(struct smack_accesses *handle,
  */
 int smack_accesses_add_from_file(struct smack_accesses *handle, int fd);
 
+/*!
+ * Set the number of threads that smack_accesses_add_from_file() may use
+ * to parse a single regular file. The file is split at line boundaries,
+ * the parts are parsed concurrently and then added to the handle in file
+ * order, so the result is the same as with a single thread. If any part
+ * has a bad rule, none of the file is added. Pipes and other files that
+ * cannot be mapped are always parsed on the calling thread.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param threads number of threads, 1 (the default) parses on the calling
+ * thread and 0 uses one thread per online CPU
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_set_threads(struct smack_accesses *handle, int threads);
+
+/*!
+ * Set how smack_accesses_apply() and the functions like it write rules to
+ * the kernel. Rules are written in chunks of whole rules of at most
+ * chunk_size bytes, by default a page, which is what older kernels take in
+ * one write. With pipelined set, the chunks are written by a thread of
+ * their own while the next ones are formatted, so that the kernel parses
+ * rules at the same time as the library prepares them.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param chunk_size maximum size of one write in bytes, 0 for a page
+ * @param pipelined non-zero to write from a separate thread
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_set_writer(struct smack_accesses *handle, int chunk_size,
+			      int pipelined);
+
+/*!
+ * Collapse rules for a subject and object pair that is already in the
+ * instance into the existing rule as they are added, instead of keeping
+ * every rule. The access that smack_accesses_apply() writes for the pair is
+ * the same either way, but the memory used grows with the number of
+ * distinct pairs rather than with the number of rules. Only rules added
+ * after the call are collapsed. Collapsing is off by default.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param collapse non-zero to collapse repeated pairs, zero to keep every
+ * rule
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_set_collapse(struct smack_accesses *handle, int collapse);
+
+/*!
+ * Load access rules from several files. The rules are added in the order
+ * of the given file descriptors, as if each of them had been passed to
+ * smack_accesses_add_from_file() in turn. When more than one thread has
+ * been set with smack_accesses_set_threads(), the files are read and
+ * parsed concurrently.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param fds array of file descriptors
+ * @param cnt number of file descriptors
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_add_from_files(struct smack_accesses *handle,
+				  const int *fds, int cnt);
+
+/*!
+ * Append the access rules of one instance to another. The labels of src
+ * are looked up in the label table of dst once each and the rules are
+ * copied by label id, so nothing is parsed again. Afterwards dst holds the
+ * same rules as if the input of src had been added to it after its own,
+ * so applying or saving it merges the rules of a subject and object pair
+ * in that order. src keeps its rules and can be merged again.
+ *
+ * @param dst handle to the instance that receives the rules
+ * @param src handle to the instance whose rules are added, not dst
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_merge(struct smack_accesses *dst,
+			 struct smack_accesses *src);
+
+/*!
+ * Write access rules to a file as a compiled policy image. The image holds
+ * the label table and the rules encoded by label id, together with a
+ * version and a checksum. It can only be loaded on a host with the same
+ * byte order.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param fd file descriptor
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_save_compiled(struct smack_accesses *handle, int fd);
+
+/*!
+ * Load access rules from a compiled policy image written by
+ * smack_accesses_save_compiled(). Labels are not parsed or validated
+ * again. Into an empty instance the image is loaded directly, otherwise
+ * its rules are added after the existing ones.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param fd file descriptor
+ * @return Returns 0 on success and negative on failure, including when
+ * the image is corrupted or has an unknown version.
+ */
+int smack_accesses_load_compiled(struct smack_accesses *handle, int fd);
+
 /*!
  * Check whether SMACK allows access for given subject, object and requested
  * access.
@@ -149,6 +349,102 @@ int smack_accesses_add_from_file(struct smack_accesses *handle, int fd);
 int smack_have_access(const char *subject, const char *object,
 		      const char *access_type);
 
+/*!
+ * Check a number of accesses with the kernel, like smack_have_access()
+ * does for one. The result of every query is stored in its result field,
+ * a query with invalid labels or access type only fails on its own.
+ *
+ * smack_have_access() and this function keep the kernel interface open
+ * per thread between calls as long as the kernel takes more than one
+ * query on an open file, see smack_have_access_release().
+ *
+ * @param queries array of queries
+ * @param cnt number of queries
+ * @return Returns 0 when every query has been processed and negative if
+ * the kernel interface cannot be used.
+ */
+int smack_have_access_batch(struct smack_access_query *queries, int cnt);
+
+/*!
+ * Release the kernel interface and buffers that smack_have_access() and
+ * smack_have_access_batch() keep for the calling thread. They are also
+ * released when the thread exits, and a child process opens its own after
+ * fork().
+ */
+void smack_have_access_release(void);
+
+/*!
+ * Enable the access decision cache of smack_have_access() and
+ * smack_have_access_batch(). With the cache, requests that the built-in
+ * Smack rules decide are answered without asking the kernel, and the
+ * answers of the kernel are kept in a table of the given number of
+ * entries, rounded up to a power of two. Lookups take no lock. Queries
+ * with a subject and an object longer than 48 characters together are
+ * not cached.
+ *
+ * The cached answers are dropped when any process applies or clears
+ * rules with libsmack or revokes a subject, which bumps a counter in
+ * /run/smack/generation. Changes written to smackfs by other means are
+ * not noticed.
+ *
+ * Enabling fails while the cache is enabled. To resize it, disable it
+ * first. Disabling frees the table, so it must not be done while other
+ * threads check accesses.
+ *
+ * @param entries number of cache entries, 0 disables the cache
+ * @return Returns 0 on success and negative on failure, for example when
+ * the cache is already enabled or the generation counter cannot be
+ * opened.
+ */
+int smack_access_cache_enable(int entries);
+
+/*!
+ * Get the counters of the access decision cache. The counters are not
+ * reset when the cache is disabled or resized.
+ *
+ * @param stats output variable for the counters
+ */
+void smack_access_cache_get_stats(struct smack_access_cache_stats *stats);
+
+/*!
+ * Get statistics of a handle: its label and rule counts, the memory it
+ * holds, how full its label dictionary is and how far lookups probe, the
+ * time spent parsing rules into it and what the last apply wrote. Rules of
+ * the same subject and object count once in merged_rules. Rules added
+ * since the last apply or check are sorted in first, like applying them
+ * would do.
+ *
+ * Only the first stats->size bytes are filled, and size is set to the
+ * number of bytes the library filled in.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param stats output variable for the statistics, with size set
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_accesses_get_stats(struct smack_accesses *handle,
+			     struct smack_accesses_stats *stats);
+
+/*!
+ * Check whether the given access rules allow access for given subject,
+ * object and requested access, without asking the kernel. The built-in
+ * Smack rules are applied first, then the rules of the pair are merged the
+ * same way smack_accesses_apply() does it. An index of all pairs is built
+ * on the first call after rules have been added, later calls only look
+ * them up.
+ *
+ * The function can be called from several threads at once, but not while
+ * rules are added to the instance.
+ *
+ * @param handle handle to a struct smack_accesses instance
+ * @param subject subject of the rule
+ * @param object object of the rule
+ * @param access_type requested access type
+ * @return Returns 1 if access is allowed, 0 if access is not allowed and
+ * negative on error.
+ */
+int smack_accesses_check(struct smack_accesses *handle, const char *subject,
+			 const char *object, const char *access_type);
+
 /*!
  * Allocates memory for a new empty smack_cipso instance. The returned
  * instance must be later freed with smack_cipso_free().
@@ -191,6 +487,30 @@ int smack_cipso_add_from_file(struct smack_cipso *handle, int fd);
  */
 const char *smack_smackfs_path(void);
 
+/*!
+ * Choose what the library uses in place of the mounted SmackFS, so that
+ * policy can be applied and checked without a Smack enabled kernel.
+ * "emulated" selects an in-process emulation of the load2, change-rule,
+ * access2 and cipso2 files, including their limit of a page per write.
+ * Any other string is taken as the path of a directory whose regular
+ * files or FIFOs stand in for the SmackFS files. NULL selects the kernel
+ * again. Without a call, the LIBSMACK_SMACKFS environment variable is
+ * read the same way, except in set-id programs and in processes running
+ * as root or with CAP_MAC_ADMIN, which always use the kernel.
+ *
+ * Call it before using the library, files that are already open, such as
+ * those of a session, stay with the former backend. smack_smackfs_path()
+ * returns the string given here.
+ *
+ * With a directory, access checks are not real decisions. The answer is
+ * whatever the access2 file reads back after the query is written, for a
+ * regular file the first byte of the query itself.
+ *
+ * @param backend "emulated", path of a directory or NULL
+ * @return Returns 0 on success and negative if the backend cannot be used.
+ */
+int smack_smackfs_set_backend(const char *backend);
+
 /*!
   * Get the label that is associated with the callers process.
   * Caller is responsible of freeing the returned label.
@@ -326,6 +646,17 @@ int smack_revoke_subject(const char *subject);
  */
 ssize_t smack_label_length(const char *label);
 
+/*!
+ * Validate a set of SMACK labels and calculate their lengths.
+ *
+ * @param labels labels to verify
+ * @param cnt number of labels
+ * @param lengths output array of cnt entries, receives the length of each
+ * label or -1 for an invalid one
+ * @return Returns 0 if all labels are valid and negative otherwise.
+ */
+int smack_label_length_batch(const char **labels, int cnt, ssize_t *lengths);
+
 /*!
  * Perform the initial policy load.
  * This function loads the Smack policy from default location and loads
@@ -378,6 +709,117 @@ int smack_set_onlycap(const char **labels, int cnt);
  */
 int smack_set_onlycap_from_file(int fd);
 
+/*!
+ * Create a session for applying rules and checking access many times.
+ * The session finds out once which interfaces the kernel offers (long or
+ * short rule format, change-rule and whether it takes several rules per
+ * write, and the attribute file of the process label) and keeps the
+ * smackfs files and write buffers open until smack_session_free().
+ * Applying a few rules then costs only the writes of the rules.
+ *
+ * A session must not be used by several threads at once. Its files are
+ * closed on exec.
+ *
+ * @param session output variable for the session
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_new(struct smack_session **session);
+
+/*!
+ * Close the files of a session and free it.
+ *
+ * @param session session to free, may be NULL
+ */
+void smack_session_free(struct smack_session *session);
+
+/*!
+ * Same as smack_accesses_apply() through the files of a session.
+ *
+ * @param session session from smack_session_new()
+ * @param handle handle to a struct smack_accesses instance
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_apply(struct smack_session *session,
+			struct smack_accesses *handle);
+
+/*!
+ * Same as smack_accesses_apply_diff() through the files of a session.
+ *
+ * @param session session from smack_session_new()
+ * @param old_handle handle to the previously applied rules
+ * @param new_handle handle to the rules to apply
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_apply_diff(struct smack_session *session,
+			     struct smack_accesses *old_handle,
+			     struct smack_accesses *new_handle);
+
+/*!
+ * Same as smack_accesses_clear() through the files of a session.
+ *
+ * @param session session from smack_session_new()
+ * @param handle handle to a struct smack_accesses instance
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_clear(struct smack_session *session,
+			struct smack_accesses *handle);
+
+/*!
+ * Read rules from a file and apply them while reading, for policies that
+ * are too big to be held in memory at once. Rules are collected until they
+ * take about max_memory bytes, then written and dropped before reading
+ * goes on. The rules in the kernel end up the same as with
+ * smack_accesses_add_from_file() and smack_session_apply(), but if a write
+ * fails the batches before it stay applied. The labels are not covered by
+ * max_memory: they are kept from batch to batch and take memory in
+ * proportion to the distinct labels of the biggest batch.
+ *
+ * @param session session from smack_session_new()
+ * @param fd file descriptor of the file, a pipe works as well
+ * @param max_memory memory in bytes to use for the rules read
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_apply_from_file(struct smack_session *session, int fd,
+				  size_t max_memory);
+
+/*!
+ * Same as smack_session_apply_from_file() but clears the rules read
+ * like smack_session_clear().
+ *
+ * @param session session from smack_session_new()
+ * @param fd file descriptor of the file, a pipe works as well
+ * @param max_memory memory in bytes to use for the rules read
+ * @return Returns 0 on success and negative on failure.
+ */
+int smack_session_clear_from_file(struct smack_session *session, int fd,
+				  size_t max_memory);
+
+/*!
+ * Same as smack_have_access() with the access file of a session.
+ *
+ * @param session session from smack_session_new()
+ * @param subject subject of the rule
+ * @param object object of the rule
+ * @param access_type requested access type
+ * @return Returns 1 if access is allowed, 0 if access is not allowed and
+ * negative on error.
+ */
+int smack_session_have_access(struct smack_session *session,
+			      const char *subject, const char *object,
+			      const char *access_type);
+
+/*!
+ * Same as smack_new_label_from_self() with the attribute file found when
+ * the session was created.
+ *
+ * @param session session from smack_session_new()
+ * @param label output variable for the label, freed by the caller
+ * @return Returns length of the label on success and negative value
+ * on failure.
+ */
+ssize_t smack_session_new_label_from_self(struct smack_session *session,
+					  char **label);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1136 @@
+/*
+ * This file is part of libsmack
+ *
+ * Copyright (C) 2013 Intel Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Micro benchmarks for the user space parts of libsmack.
+ *
+ * The library sources are included directly so that internal functions
+ * can be measured too. Every result is printed as one line of
+ * space separated key=value pairs.
+ */
+
+#include "../libsmack/libsmack.c"
+#include <dirent.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/resource.h>
+
+typedef int (*bench_func)(int argc, char **argv);
+
+/* Allocations made by the code built into the benchmark. The Makefile
+ * links it with --wrap for malloc(), calloc() and realloc(). */
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long count_lines(int fd)
+{
+	char buf[65536];
+	ssize_t len;
+	ssize_t i;
+	long lines = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < len; i++)
+			lines += buf[i] == '\n';
+
+	lseek(fd, 0, SEEK_SET);
+	return lines;
+}
+
+/*
+ * Parses each given policy file into a fresh handle and frees it again,
+ * timing both steps separately. Leading arguments threads=N and
+ * collapse=N set the number of parser threads and whether repeated pairs
+ * are collapsed, rules is the number of rules kept.
+ */
+static int bench_parse(int argc, char **argv)
+{
+	struct smack_accesses *handle;
+	uint64_t start, parsed, freed;
+	uint32_t rules;
+	long lines;
+	int threads = 1;
+	int collapse = 0;
+	int fd;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		if (sscanf(argv[i], "threads=%d", &threads) != 1 &&
+		    sscanf(argv[i], "collapse=%d", &collapse) != 1)
+			break;
+
+	for (; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[i]);
+			return -1;
+		}
+		lines = count_lines(fd);
+
+		start = now_ns();
+		if (smack_accesses_new(&handle) ||
+		    smack_accesses_set_threads(handle, threads) ||
+		    smack_accesses_set_collapse(handle, collapse) ||
+		    smack_accesses_add_from_file(handle, fd) ||
+		    accesses_finalize(handle)) {
+			fprintf(stderr, "Parsing '%s' failed.\n", argv[i]);
+			close(fd);
+			return -1;
+		}
+		parsed = now_ns();
+		rules = handle->rules_cnt;
+		smack_accesses_free(handle);
+		freed = now_ns();
+		close(fd);
+
+		printf("bench=parse file=%s threads=%d collapse=%d lines=%ld rules=%u parse_ms=%.3f free_ms=%.3f\n",
+		       argv[i], threads, collapse, lines, rules,
+		       (parsed - start) / 1e6, (freed - parsed) / 1e6);
+	}
+
+	return 0;
+}
+
+/*
+ * Parses each given policy file into a handle of its own and then times
+ * merging all of them into one handle, against parsing the files into one
+ * handle directly.
+ */
+static int bench_merge(int argc, char **argv)
+{
+	struct smack_accesses **shards;
+	struct smack_accesses *handle;
+	uint64_t start, merge_ns, parse_ns;
+	int fd;
+	int i;
+
+	shards = calloc(argc, sizeof(struct smack_accesses *));
+	if (shards == NULL || smack_accesses_new(&handle))
+		return -1;
+
+	for (i = 0; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0) {
+			perror(argv[i]);
+			return -1;
+		}
+		if (smack_accesses_new(&shards[i]) ||
+		    smack_accesses_add_from_file(shards[i], fd)) {
+			fprintf(stderr, "Parsing '%s' failed.\n", argv[i]);
+			return -1;
+		}
+		close(fd);
+	}
+
+	start = now_ns();
+	for (i = 0; i < argc; i++)
+		if (smack_accesses_merge(handle, shards[i]))
+			return -1;
+	if (accesses_finalize(handle))
+		return -1;
+	merge_ns = now_ns() - start;
+	smack_accesses_free(handle);
+
+	if (smack_accesses_new(&handle))
+		return -1;
+	start = now_ns();
+	for (i = 0; i < argc; i++) {
+		fd = open(argv[i], O_RDONLY);
+		if (fd < 0 || smack_accesses_add_from_file(handle, fd))
+			return -1;
+		close(fd);
+	}
+	if (accesses_finalize(handle))
+		return -1;
+	parse_ns = now_ns() - start;
+
+	printf("bench=merge files=%d rules=%u merge_ms=%.3f parse_ms=%.3f\n",
+	       argc, handle->rules_cnt, merge_ns / 1e6, parse_ns / 1e6);
+
+	smack_accesses_free(handle);
+	for (i = 0; i < argc; i++)
+		smack_accesses_free(shards[i]);
+	free(shards);
+	return 0;
+}
+
+static char **make_labels(int count, char first)
+{
+	char **labels;
+	int len;
+	int i;
+
+	labels = malloc(count * sizeof(char *));
+	if (labels == NULL)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		len = 4 + random() % 20;
+		labels[i] = malloc(len + 1);
+		if (labels[i] == NULL)
+			return NULL;
+		labels[i][0] = first;
+		labels[i][len] = '\0';
+		while (--len)
+			labels[i][len] = 'A' + random() % 26;
+	}
+
+	return labels;
+}
+
+/*
+ * Fills a handle with 1k, 10k and 100k labels and measures dictionary
+ * lookups of known labels (through label_add()) and of unknown ones.
+ */
+static int bench_labels(int argc, char **argv)
+{
+	static const int counts[] = {1000, 10000, 100000};
+	const int lookups = 1000000;
+	struct smack_accesses *handle;
+	char **known;
+	char **unknown;
+	uint32_t hash = 0;
+	uint64_t start, hit_ns, miss_ns;
+	unsigned int c;
+	long found = 0;
+	int count;
+	int idx;
+	int i;
+
+	(void) argc;
+	(void) argv;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		count = counts[c];
+		srandom(count);
+		known = make_labels(count, 'A');
+		unknown = make_labels(count, 'a');
+		if (known == NULL || unknown == NULL ||
+		    smack_accesses_new(&handle))
+			return -1;
+
+		for (i = 0; i < count; i++)
+			if (label_add(handle, known[i]) < 0)
+				return -1;
+
+		start = now_ns();
+		for (i = 0, idx = 0; i < lookups; i++) {
+			found += label_add(handle, known[idx]) >= 0;
+			idx = (idx + 7919) % count;
+		}
+		hit_ns = now_ns() - start;
+
+		start = now_ns();
+		for (i = 0, idx = 0; i < lookups; i++) {
+			const char *label = unknown[idx];
+			int len = get_label(NULL, label, &hash);
+			found += is_label_known(handle, label, len, hash) >= 0;
+			idx = (idx + 7919) % count;
+		}
+		miss_ns = now_ns() - start;
+
+		printf("bench=labels labels=%d lookups=%d hit_ns=%.1f miss_ns=%.1f\n",
+		       count, lookups, (double) hit_ns / lookups,
+		       (double) miss_ns / lookups);
+
+		smack_accesses_free(handle);
+		for (i = 0; i < count; i++) {
+			free(known[i]);
+			free(unknown[i]);
+		}
+		free(known);
+		free(unknown);
+	}
+
+	return found == lookups * 3L ? 0 : -1;
+}
+
+static uint64_t bench_span(int (*span)(const char *, const char *, uint32_t *),
+			   char **labels, int count, int rounds)
+{
+	uint64_t start;
+	uint32_t hash;
+	uint32_t sum = 0;
+	int len;
+	int r;
+	int i;
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < count; i++) {
+			len = span(labels[i], labels[i] +
+				   strnlen(labels[i], SMACK_LABEL_LEN + 1), &hash);
+			if (labels[i][len] != '\0')
+				return 0;
+			sum += hash;
+		}
+
+	return sum ? now_ns() - start : 0;
+}
+
+/*
+ * Validates and hashes short (10 character) and long (200 character)
+ * labels with each label_span() variant and with the batch API.
+ */
+static int bench_labelcheck(int argc, char **argv)
+{
+	static const int lengths[] = {10, 200};
+	const int count = 100000;
+	const int rounds = 20;
+	const long total = (long) count * rounds;
+	ssize_t *label_lengths;
+	char **labels;
+	uint64_t start, ns;
+	unsigned int l;
+	int r;
+	int i;
+	int j;
+
+	(void) argc;
+	(void) argv;
+
+	labels = malloc(count * sizeof(char *));
+	label_lengths = malloc(count * sizeof(ssize_t));
+	if (labels == NULL || label_lengths == NULL)
+		return -1;
+
+	for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		srandom(lengths[l]);
+		for (i = 0; i < count; i++) {
+			labels[i] = malloc(lengths[l] + 1);
+			if (labels[i] == NULL)
+				return -1;
+			for (j = 0; j < lengths[l]; j++) {
+				do
+					labels[i][j] = '!' + random() % 94;
+				while (!label_char_valid(labels[i][j]) ||
+				       (j == 0 && labels[i][j] == '-'));
+			}
+			labels[i][j] = '\0';
+		}
+
+		ns = bench_span(label_span_scalar, labels, count, rounds);
+		printf("bench=labelcheck impl=scalar len=%d ns_per_label=%.2f\n",
+		       lengths[l], (double) ns / total);
+#ifdef HAVE_LABEL_SPAN_SIMD
+		if (__builtin_cpu_supports("sse2")) {
+			ns = bench_span(label_span_sse2, labels, count, rounds);
+			printf("bench=labelcheck impl=sse2 len=%d ns_per_label=%.2f\n",
+			       lengths[l], (double) ns / total);
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			ns = bench_span(label_span_avx2, labels, count, rounds);
+			printf("bench=labelcheck impl=avx2 len=%d ns_per_label=%.2f\n",
+			       lengths[l], (double) ns / total);
+		}
+#endif
+
+		start = now_ns();
+		for (r = 0; r < rounds; r++)
+			if (smack_label_length_batch((const char **) labels, count,
+						     label_lengths))
+				return -1;
+		ns = now_ns() - start;
+		printf("bench=labelcheck impl=batch len=%d ns_per_label=%.2f\n",
+		       lengths[l], (double) ns / total);
+
+		for (i = 0; i < count; i++)
+			free(labels[i]);
+	}
+
+	free(label_lengths);
+	free(labels);
+	return 0;
+}
+
+/*
+ * Loads a policy file and answers access queries from it with
+ * smack_accesses_check(). Half of the queries hit a rule of the policy,
+ * the other half are random label pairs.
+ */
+static int bench_check(int argc, char **argv)
+{
+	const int count = 1 << 20;
+	const int rounds = 10;
+	struct smack_accesses *handle;
+	struct smack_rule *rule;
+	const char **subjects;
+	const char **objects;
+	uint64_t start, build_ns, ns;
+	long allowed = 0;
+	uint32_t i;
+	int x;
+	int r;
+	int fd;
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: check FILE\n");
+		return -1;
+	}
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0 || smack_accesses_new(&handle) ||
+	    smack_accesses_add_from_file(handle, fd))
+		return -1;
+	close(fd);
+
+	start = now_ns();
+	if (smack_accesses_check(handle, "a", "b", "r") < 0)
+		return -1;
+	build_ns = now_ns() - start;
+
+	subjects = malloc(count * sizeof(char *));
+	objects = malloc(count * sizeof(char *));
+	if (subjects == NULL || objects == NULL || handle->rules_cnt == 0)
+		return -1;
+
+	srandom(1);
+	for (i = 0; i < (uint32_t) count; i++) {
+		if (i & 1) {
+			subjects[i] = label_str(handle, random() % handle->labels_cnt);
+			objects[i] = label_str(handle, random() % handle->labels_cnt);
+			continue;
+		}
+		do
+			x = random() % handle->labels_cnt;
+		while (handle->rules_start[x] == handle->rules_start[x + 1]);
+		rule = &handle->rules[handle->rules_start[x] + random() %
+			(handle->rules_start[x + 1] - handle->rules_start[x])];
+		subjects[i] = label_str(handle, x);
+		objects[i] = label_str(handle, rule->object_id);
+	}
+
+	start = now_ns();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < (uint32_t) count; i++)
+			allowed += smack_accesses_check(handle, subjects[i],
+							objects[i], "r") == 1;
+	ns = now_ns() - start;
+
+	printf("bench=check file=%s rules=%u build_ms=%.3f queries=%ld ns_per_query=%.1f queries_per_s=%.0f allowed=%ld\n",
+	       argv[0], handle->rules_cnt, build_ns / 1e6, (long) count * rounds,
+	       (double) ns / count / rounds, count * rounds / (ns / 1e9),
+	       allowed);
+
+	free(objects);
+	free(subjects);
+	smack_accesses_free(handle);
+	return 0;
+}
+
+/*
+ * Times smack_have_access() with the access file kept open between calls
+ * and with it opened for every call, as kernels that take one query per
+ * open file need. Without smackfs mounted, a directory holding a regular
+ * access2 file can stand in for it, which measures the library and
+ * syscall overhead only. The last mode answers from the access decision
+ * cache after the first call.
+ */
+static int bench_access(int argc, char **argv)
+{
+	static const char *modes[] = {"reuse", "reopen", "cached"};
+	const int count = 200000;
+	struct smack_access_cache_stats stats;
+	struct smack_access_state *state;
+	uint64_t start, ns;
+	unsigned int m;
+	int fd;
+	int i;
+
+	if (argc == 1) {
+		smackfs_mnt = strdup(argv[0]);
+		smackfs_mnt_dirfd = open(argv[0], O_RDONLY | O_DIRECTORY);
+		if (smackfs_mnt_dirfd < 0)
+			return -1;
+		fd = openat(smackfs_mnt_dirfd, "access2",
+			    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return -1;
+		close(fd);
+	} else if (init_smackfs_mnt()) {
+		fprintf(stderr, "usage: access [DIR] (SmackFS is not mounted)\n");
+		return -1;
+	}
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		smack_have_access_release();
+		state = access_state_get();
+		if (state == NULL)
+			return -1;
+		state->reuse = m != 1;
+		if (m == 2 && smack_access_cache_enable(1024))
+			return -1;
+
+		start = now_ns();
+		for (i = 0; i < count; i++)
+			if (smack_have_access("System", "User::App", "rw") < 0)
+				return -1;
+		ns = now_ns() - start;
+
+		printf("bench=access mode=%s smackfs=%s checks=%d ns_per_check=%.1f reused=%d\n",
+		       modes[m], smackfs_mnt, count, (double) ns / count,
+		       state->reuse);
+	}
+
+	smack_access_cache_get_stats(&stats);
+	printf("bench=access-cache hits=%llu misses=%llu builtin=%llu\n",
+	       stats.hits, stats.misses, stats.builtin);
+
+	smack_access_cache_enable(0);
+	smack_have_access_release();
+	return 0;
+}
+
+/*
+ * Applies a small rule set again and again, opening the kernel interfaces
+ * for every call and through a session that keeps them open. As for
+ * access, a directory with regular load2 and change-rule files can stand
+ * in for smackfs.
+ */
+static int bench_session(int argc, char **argv)
+{
+	static const char *files[] = {"load2", "change-rule"};
+	const int count = 20000;
+	struct smack_accesses *handle;
+	struct smack_session *session;
+	uint64_t start, apply_ns, session_ns;
+	char subject[16];
+	unsigned int f;
+	int fd;
+	int i;
+
+	if (argc == 1) {
+		smackfs_mnt = strdup(argv[0]);
+		smackfs_mnt_dirfd = open(argv[0], O_RDONLY | O_DIRECTORY);
+		if (smackfs_mnt_dirfd < 0)
+			return -1;
+		for (f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+			fd = openat(smackfs_mnt_dirfd, files[f],
+				    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (fd < 0)
+				return -1;
+			close(fd);
+		}
+	} else if (init_smackfs_mnt()) {
+		fprintf(stderr, "usage: session [DIR] (SmackFS is not mounted)\n");
+		return -1;
+	}
+
+	if (smack_accesses_new(&handle))
+		return -1;
+	for (i = 0; i < 8; i++) {
+		snprintf(subject, sizeof(subject), "App::%d", i);
+		if (smack_accesses_add(handle, subject, "System", "rwx") ||
+		    smack_accesses_add_modify(handle, "System", subject, "r", "w"))
+			return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		if (smack_accesses_apply(handle))
+			return -1;
+	apply_ns = now_ns() - start;
+
+	if (smack_session_new(&session))
+		return -1;
+	start = now_ns();
+	for (i = 0; i < count; i++)
+		if (smack_session_apply(session, handle))
+			return -1;
+	session_ns = now_ns() - start;
+	smack_session_free(session);
+
+	printf("bench=session smackfs=%s applies=%d rules=16 apply_us=%.2f session_us=%.2f\n",
+	       smackfs_mnt, count, apply_ns / 1e3 / count,
+	       session_ns / 1e3 / count);
+
+	smack_accesses_free(handle);
+	return 0;
+}
+
+/*
+ * Applies a policy file with rules written from the calling thread and
+ * from a writer thread. A leading chunk=N sets the write size. Without
+ * smackfs, a directory with regular files stands in for it, which
+ * measures formatting and the copy into the page cache. Multi-line
+ * writes are assumed there, as regular files cannot tell.
+ */
+static int bench_write(int argc, char **argv)
+{
+	static const char *modes[] = {"sync", "pipelined"};
+	static const char *files[] = {"load2", "change-rule"};
+	struct smack_accesses *handle;
+	struct smack_session *session;
+	uint64_t start, ns;
+	int chunk = 0;
+	unsigned int m;
+	unsigned int f;
+	int fake = 0;
+	int fd;
+
+	if (argc > 0 && sscanf(argv[0], "chunk=%d", &chunk) == 1) {
+		argc--;
+		argv++;
+	}
+	if (argc < 1) {
+		fprintf(stderr, "usage: write [chunk=N] FILE [DIR]\n");
+		return -1;
+	}
+
+	if (argc > 1) {
+		smackfs_mnt = strdup(argv[1]);
+		smackfs_mnt_dirfd = open(argv[1], O_RDONLY | O_DIRECTORY);
+		if (smackfs_mnt_dirfd < 0)
+			return -1;
+		fake = 1;
+	} else if (init_smackfs_mnt()) {
+		fprintf(stderr, "usage: write [chunk=N] FILE [DIR] (SmackFS is not mounted)\n");
+		return -1;
+	}
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0 || smack_accesses_new(&handle) ||
+	    smack_accesses_add_from_file(handle, fd) ||
+	    accesses_finalize(handle))
+		return -1;
+	close(fd);
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		for (f = 0; fake && f < sizeof(files) / sizeof(files[0]); f++) {
+			fd = openat(smackfs_mnt_dirfd, files[f],
+				    O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (fd < 0)
+				return -1;
+			close(fd);
+		}
+
+		if (smack_accesses_set_writer(handle, chunk, m == 1) ||
+		    smack_session_new(&session))
+			return -1;
+		if (fake)
+			session->multiline = 1;
+
+		start = now_ns();
+		if (smack_session_apply(session, handle))
+			return -1;
+		ns = now_ns() - start;
+		smack_session_free(session);
+
+		printf("bench=write mode=%s smackfs=%s chunk=%d rules=%u apply_ms=%.3f rules_per_s=%.0f\n",
+		       modes[m], smackfs_mnt, handle->write_chunk,
+		       handle->rules_cnt, ns / 1e6, handle->rules_cnt * 1e9 / ns);
+	}
+
+	smack_accesses_free(handle);
+	return 0;
+}
+
+/*
+ * Renders rules into a write buffer in the long, the long modify and the
+ * short format, and the short format through snprintf() as before for
+ * comparison. Labels are 4 to 23 characters long so that all formats can
+ * take them.
+ */
+static int bench_render(int argc, char **argv)
+{
+	static const char *modes[] = {"long", "modify", "short", "short-snprintf"};
+	const int count = 1024;
+	const int rules = 4000000;
+	struct smack_file_buffer buffer = {.fd = -1};
+	uint64_t start, ns;
+	unsigned int m;
+	char **strs;
+	int *lens;
+	int code;
+	int s;
+	int o;
+	int ret = 0;
+	int i;
+
+	(void) argc;
+	(void) argv;
+
+	srandom(1);
+	strs = make_labels(count, 'A');
+	lens = calloc(count, sizeof(int));
+	buffer.size = sysconf(_SC_PAGESIZE) + LOAD_LEN;
+	buffer.buf = malloc(buffer.size);
+	if (strs == NULL || lens == NULL || buffer.buf == NULL)
+		return -1;
+	for (i = 0; i < count; i++)
+		lens[i] = strlen(strs[i]);
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		start = now_ns();
+		for (i = 0; i < rules && ret == 0; i++) {
+			code = i & ACCESS_TYPE_ALL;
+			s = i % count;
+			o = (i >> 10) % count;
+			if (buffer.pos + LOAD_LEN + 1 >= buffer.size)
+				buffer.pos = 0;
+			switch (m) {
+			case 0:
+				ret = rule_print_long(&buffer, strs[s], lens[s],
+					strs[o], lens[o], access_strs[code],
+					NULL);
+				break;
+			case 1:
+				ret = rule_print_long(&buffer, strs[s], lens[s],
+					strs[o], lens[o], access_strs[code],
+					access_strs[~code & ACCESS_TYPE_ALL]);
+				break;
+			case 2:
+				ret = rule_print_short(&buffer, strs[s], lens[s],
+					strs[o], lens[o], access_strs[code]);
+				break;
+			default:
+				buffer.pos += snprintf(buffer.buf + buffer.pos,
+					buffer.size - buffer.pos,
+					KERNEL_SHORT_FORMAT, strs[s], strs[o],
+					access_strs[code]);
+				break;
+			}
+			buffer.buf[buffer.pos++] = '\n';
+		}
+		ns = now_ns() - start;
+		if (ret)
+			return -1;
+
+		printf("bench=render format=%s rules=%d ns_per_rule=%.2f\n",
+		       modes[m], rules, (double) ns / rules);
+	}
+
+	for (i = 0; i < count; i++)
+		free(strs[i]);
+	free(strs);
+	free(lens);
+	free(buffer.buf);
+	return 0;
+}
+
+
+/* Per phase totals of the suite, divided by the repetitions at the end */
+struct suite_phase {
+	uint64_t ns;
+	unsigned long allocs;
+};
+
+static void phase_begin(struct suite_phase *phase, uint64_t *start)
+{
+	phase->allocs -= allocs;
+	*start = now_ns();
+}
+
+static void phase_end(struct suite_phase *phase, uint64_t start)
+{
+	phase->ns += now_ns() - start;
+	phase->allocs += allocs;
+}
+
+/*
+ * Resets the peak resident set size of the process, which Linux allows
+ * since 4.0. Returns -1 if it could not be reset.
+ */
+static int peak_rss_reset(void)
+{
+	int fd;
+	int ret;
+
+	fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, "5", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* Returns the peak resident set size in kB */
+static long peak_rss_kb(void)
+{
+	struct rusage usage;
+	char line[128];
+	long kb = -1;
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp))
+			if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+				break;
+		fclose(fp);
+	}
+
+	if (kb < 0 && getrusage(RUSAGE_SELF, &usage) == 0)
+		kb = usage.ru_maxrss;
+	return kb;
+}
+
+/*
+ * Splits a policy name of make_policies.bash such as "log64m2" or
+ * "2min128sorted" into its type, label count and merge factor. Sorted
+ * policies have no repeated rules, their merge factor is 0.
+ */
+static int suite_name(const char *name, char *type, int *labels, int *merge,
+		      int *sorted)
+{
+	static const char *types[] = {"2min", "min", "log", "max"};
+	const char *p = NULL;
+	char *end;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (!strncmp(name, types[i], strlen(types[i]))) {
+			strcpy(type, types[i]);
+			p = name + strlen(types[i]);
+			break;
+		}
+	}
+	if (p == NULL)
+		return -1;
+
+	*labels = strtol(p, &end, 10);
+	if (end == p)
+		return -1;
+	*sorted = !strcmp(end, "sorted");
+	if (*sorted) {
+		*merge = 0;
+		return 0;
+	}
+
+	if (sscanf(end, "m%d", merge) != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Reads the subject and object of every rule of the file as strings
+ * pointing into *buf.
+ */
+static char **suite_labels(int fd, char **buf, int *cnt)
+{
+	struct stat sb;
+	char **labels;
+	char *line;
+	char *save;
+	char *save_tok;
+	char *tok;
+	int alloc;
+	int i;
+
+	if (fstat(fd, &sb) == -1)
+		return NULL;
+	*buf = malloc(sb.st_size + 1);
+	if (*buf == NULL || pread(fd, *buf, sb.st_size, 0) != sb.st_size)
+		return NULL;
+	(*buf)[sb.st_size] = '\0';
+
+	alloc = 1024;
+	labels = malloc(alloc * sizeof(char *));
+	if (labels == NULL)
+		return NULL;
+
+	*cnt = 0;
+	for (line = strtok_r(*buf, "\n", &save); line != NULL;
+	     line = strtok_r(NULL, "\n", &save)) {
+		for (i = 0; i < 2; i++) {
+			tok = strtok_r(i ? NULL : line, " \t", &save_tok);
+			if (tok == NULL)
+				break;
+			if (*cnt == alloc) {
+				alloc <<= 1;
+				labels = realloc(labels, alloc * sizeof(char *));
+				if (labels == NULL)
+					return NULL;
+			}
+			labels[(*cnt)++] = tok;
+		}
+	}
+
+	return labels;
+}
+
+/*
+ * Runs the user space steps of loading one policy again and again for at
+ * least min_ms each: label validation with get_label(), interning with
+ * label_add(), parsing with smack_accesses_add_from_file() (and sorting
+ * the rules by subject), rendering with accesses_print() into a memfd
+ * and smack_accesses_free().
+ */
+static int suite_policy(const char *path, uint64_t min_ns, int memfd)
+{
+	struct suite_phase get = {0}, add = {0}, parse = {0}, print = {0},
+			   release = {0}, apply = {0};
+	struct smack_accesses_stats stats = {.size = sizeof(stats)};
+	struct smack_file_buffer buffer = {.fd = memfd};
+	struct smack_accesses *handle;
+	uint32_t hash = 0;
+	uint64_t start;
+	uint32_t rules = 0;
+	off_t bytes = 0;
+	unsigned long get_reps, add_reps, reps, apply_reps;
+	long peak_rss;
+	char type[8];
+	char *buf = NULL;
+	char **labels;
+	int labels_cnt = 0;
+	int size, merge, sorted;
+	int ret = -1;
+	int fd;
+	int i;
+
+	if (suite_name(basename((char *) path), type, &size, &merge, &sorted))
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	labels = suite_labels(fd, &buf, &labels_cnt);
+	if (labels == NULL || labels_cnt == 0)
+		goto out;
+
+	buffer.chunk = 1 << 20;
+	buffer.size = buffer.chunk + LOAD_LEN;
+	buffer.buf = malloc(buffer.size);
+	if (buffer.buf == NULL)
+		goto out;
+
+	peak_rss_reset();
+
+	for (get_reps = 0; get_reps == 0 || get.ns < min_ns; get_reps++) {
+		phase_begin(&get, &start);
+		for (i = 0; i < labels_cnt; i++)
+			if (get_label(NULL, labels[i], &hash) < 0)
+				goto out;
+		phase_end(&get, start);
+	}
+
+	for (add_reps = 0; add_reps == 0 || add.ns < min_ns; add_reps++) {
+		if (smack_accesses_new(&handle))
+			goto out;
+		phase_begin(&add, &start);
+		for (i = 0; i < labels_cnt; i++)
+			if (label_add(handle, labels[i]) < 0)
+				goto out;
+		phase_end(&add, start);
+		smack_accesses_free(handle);
+	}
+
+	for (reps = 0; reps == 0 || parse.ns + print.ns + release.ns < min_ns;
+	     reps++) {
+		if (lseek(fd, 0, SEEK_SET) == -1 ||
+		    ftruncate(memfd, 0) || lseek(memfd, 0, SEEK_SET) == -1)
+			goto out;
+
+		phase_begin(&parse, &start);
+		if (smack_accesses_new(&handle) ||
+		    smack_accesses_add_from_file(handle, fd) ||
+		    accesses_finalize(handle))
+			goto out;
+		phase_end(&parse, start);
+		rules = handle->rules_cnt;
+
+		phase_begin(&print, &start);
+		if (accesses_print(handle, 0, 1, 1, &buffer, &buffer))
+			goto out;
+		phase_end(&print, start);
+
+		phase_begin(&release, &start);
+		smack_accesses_free(handle);
+		phase_end(&release, start);
+	}
+	bytes = lseek(memfd, 0, SEEK_END);
+	peak_rss = peak_rss_kb();
+
+	/* End to end, into the smackfs emulation set up by bench_suite() */
+	if (lseek(fd, 0, SEEK_SET) == -1 || smack_accesses_new(&handle) ||
+	    smack_accesses_add_from_file(handle, fd))
+		goto out;
+	for (apply_reps = 0; apply_reps == 0 || apply.ns < min_ns;
+	     apply_reps++) {
+		phase_begin(&apply, &start);
+		if (smack_accesses_apply(handle))
+			goto out;
+		phase_end(&apply, start);
+	}
+	smack_accesses_get_stats(handle, &stats);
+	smack_accesses_free(handle);
+
+	printf("bench=suite policy=%s type=%s labels=%d merge=%d sorted=%d rules=%u reps=%lu"
+	       " get_label_ns=%.2f label_add_ns=%.2f label_add_allocs=%lu"
+	       " parse_ns_per_rule=%.2f parse_rules_per_s=%.0f parse_allocs=%lu"
+	       " print_ns_per_rule=%.2f print_rules_per_s=%.0f print_bytes=%lld print_allocs=%lu"
+	       " free_us=%.3f free_allocs=%lu"
+	       " apply_ns_per_rule=%.2f apply_rules_per_s=%.0f apply_writes=%llu"
+	       " apply_allocs=%lu peak_rss_kb=%ld\n",
+	       basename((char *) path), type, size, merge, sorted, rules,
+	       reps, (double) get.ns / get_reps / labels_cnt,
+	       (double) add.ns / add_reps / labels_cnt, add.allocs / add_reps,
+	       (double) parse.ns / reps / rules,
+	       rules * 1e9 * reps / parse.ns, parse.allocs / reps,
+	       (double) print.ns / reps / rules,
+	       rules * 1e9 * reps / print.ns, (long long) bytes,
+	       print.allocs / reps, release.ns / 1e3 / reps,
+	       release.allocs / reps,
+	       (double) apply.ns / apply_reps / rules,
+	       rules * 1e9 * apply_reps / apply.ns,
+	       (unsigned long long) stats.writes, apply.allocs / apply_reps,
+	       peak_rss);
+	ret = 0;
+out:
+	if (ret)
+		fprintf(stderr, "Benchmarking '%s' failed.\n", path);
+	free(buffer.buf);
+	free(labels);
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+static int path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Runs suite_policy() on the policies of make_policies.bash, by default
+ * all of ./out. Arguments can be policy files or directories of them, a
+ * leading min_ms=N sets the least time spent in every step (default 50).
+ * Rules are applied to the emulated smackfs, no Smack kernel is needed.
+ */
+static int bench_suite(int argc, char **argv)
+{
+	static char *default_dir[] = {"out"};
+	struct dirent *dent;
+	char **paths = NULL;
+	int paths_cnt = 0;
+	int min_ms = 50;
+	int memfd;
+	int ret = 0;
+	DIR *dir;
+	int i;
+
+	if (argc > 0 && sscanf(argv[0], "min_ms=%d", &min_ms) == 1) {
+		argc--;
+		argv++;
+	}
+	if (argc == 0) {
+		argc = 1;
+		argv = default_dir;
+	}
+
+	for (i = 0; i < argc; i++) {
+		dir = opendir(argv[i]);
+		if (dir == NULL) {
+			paths = realloc(paths, (paths_cnt + 1) * sizeof(char *));
+			if (paths == NULL)
+				return -1;
+			paths[paths_cnt++] = strdup(argv[i]);
+			continue;
+		}
+		while ((dent = readdir(dir)) != NULL) {
+			if (dent->d_name[0] == '.')
+				continue;
+			paths = realloc(paths, (paths_cnt + 1) * sizeof(char *));
+			if (paths == NULL ||
+			    asprintf(&paths[paths_cnt++], "%s/%s", argv[i],
+				     dent->d_name) < 0)
+				return -1;
+		}
+		closedir(dir);
+	}
+	qsort(paths, paths_cnt, sizeof(char *), path_cmp);
+
+	memfd = memfd_create("bench", MFD_CLOEXEC);
+	if (memfd < 0 || smack_smackfs_set_backend("emulated"))
+		return -1;
+
+	for (i = 0; i < paths_cnt && ret == 0; i++)
+		ret = suite_policy(paths[i], min_ms * 1000000ULL, memfd);
+
+	for (i = 0; i < paths_cnt; i++)
+		free(paths[i]);
+	free(paths);
+	close(memfd);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	bench_func func;
+} benches[] = {
+	{"parse", bench_parse},
+	{"merge", bench_merge},
+	{"labels", bench_labels},
+	{"labelcheck", bench_labelcheck},
+	{"check", bench_check},
+	{"access", bench_access},
+	{"session", bench_session},
+	{"write", bench_write},
+	{"render", bench_render},
+	{"suite", bench_suite},
+};
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <bench> [args...]\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		if (!strcmp(argv[1], benches[i].name))
+			return benches[i].func(argc - 2, argv + 2) ? 1 : 0;
+
+	fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+	return 1;
+}
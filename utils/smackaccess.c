@@ -30,26 +30,147 @@
 #include <getopt.h>
 #include "config.h"
 
+#define READ_SIZE 65536
+
 static const char usage[] =
 	"Usage: %s [options] <subject> <object> <access>\n"
+	"       %s [options] --batch\n"
 	"options:\n"
 	" -v --version       output version information and exit\n"
 	" -h --help          output usage information and exit\n"
+	" -b --batch         read '<subject> <object> <access>' lines from\n"
+	"                    standard input and print one result per line\n"
 ;
 
-static const char short_options[] = "vh";
+static const char short_options[] = "vhb";
 
 static struct option options[] = {
 	{"version", no_argument, 0, 'v'},
 	{"help", no_argument, 0, 'h'},
+	{"batch", no_argument, 0, 'b'},
 	{NULL, 0, 0, 0}
 };
 
+/*
+ * Splits the lines in buf into queries. Lines that do not have three
+ * words get a NULL access type, which makes the query fail.
+ */
+static int parse_queries(char *buf, char *end,
+			 struct smack_access_query *queries)
+{
+	struct smack_access_query *query;
+	char *line_end;
+	char *save;
+	int cnt = 0;
+
+	for (; buf < end; buf = line_end + 1) {
+		line_end = memchr(buf, '\n', end - buf);
+		*line_end = '\0';
+
+		query = &queries[cnt++];
+		query->subject = strtok_r(buf, " \t", &save);
+		query->object = strtok_r(NULL, " \t", &save);
+		query->access_type = strtok_r(NULL, " \t", &save);
+		if (query->access_type && strtok_r(NULL, " \t", &save))
+			query->access_type = NULL;
+	}
+
+	return cnt;
+}
+
+/*
+ * Answers the queries on standard input. Everything that has been read
+ * at once is checked as one batch, so that interactive use still gets
+ * an answer for every line.
+ */
+static int check_batch(void)
+{
+	struct smack_access_query *queries = NULL;
+	size_t size = READ_SIZE;
+	size_t len = 0;
+	char *line_end;
+	char *buf;
+	char *tmp;
+	char *p;
+	ssize_t ret;
+	int failed = 0;
+	int alloc = 0;
+	int cnt;
+	int i;
+
+	buf = malloc(size + 1);
+	if (buf == NULL)
+		return -1;
+
+	for (;;) {
+		if (len == size) {
+			tmp = realloc(buf, (size << 1) + 1);
+			if (tmp == NULL)
+				goto err_out;
+			buf = tmp;
+			size <<= 1;
+		}
+
+		ret = read(STDIN_FILENO, buf + len, size - len);
+		if (ret < 0)
+			goto err_out;
+		if (ret == 0) {
+			if (len == 0 || buf[len - 1] == '\n')
+				break;
+			/* Last line without a newline */
+			buf[len++] = '\n';
+		} else
+			len += ret;
+
+		for (line_end = buf + len; line_end > buf; --line_end)
+			if (line_end[-1] == '\n')
+				break;
+		if (line_end == buf)
+			continue;
+
+		/* Every line, even an empty one, gets a query and an answer */
+		for (cnt = 0, p = buf; p < line_end; ++p)
+			cnt += *p == '\n';
+		if (cnt > alloc) {
+			tmp = realloc(queries,
+				      cnt * sizeof(struct smack_access_query));
+			if (tmp == NULL)
+				goto err_out;
+			queries = (struct smack_access_query *) tmp;
+			alloc = cnt;
+		}
+
+		cnt = parse_queries(buf, line_end, queries);
+		if (smack_have_access_batch(queries, cnt))
+			goto err_out;
+		for (i = 0; i < cnt; i++) {
+			printf("%d\n", queries[i].result);
+			failed |= queries[i].result < 0;
+		}
+		fflush(stdout);
+
+		len = buf + len - line_end;
+		memmove(buf, line_end, len);
+		if (ret == 0)
+			break;
+	}
+
+	free(queries);
+	free(buf);
+	return failed ? -1 : 0;
+
+err_out:
+	free(queries);
+	free(buf);
+	return -1;
+}
+
 int main(int argc, char **argv)
 {
 	const char *subject;
 	const char *object;
 	const char *access;
+	int batch = 0;
 	int ret;
 	int c;
 
@@ -60,21 +181,37 @@ int main(int argc, char **argv)
 			break;
 
 		switch (c) {
+		case 'b':
+			batch = 1;
+			break;
 		case 'v':
 			printf("%s (libsmack) version " PACKAGE_VERSION "\n",
 			       basename(argv[0]));
 			exit(0);
 		case 'h':
-			printf(usage, basename(argv[0]));
+			printf(usage, basename(argv[0]), basename(argv[0]));
 			exit(0);
 		default:
-			printf(usage, basename(argv[0]));
+			printf(usage, basename(argv[0]), basename(argv[0]));
+			exit(1);
+		}
+	}
+
+	if (batch) {
+		if (optind != argc) {
+			printf(usage, basename(argv[0]), basename(argv[0]));
 			exit(1);
 		}
+		if (check_batch()) {
+			fprintf(stderr, "%s: checking accesses failed.\n",
+				basename(argv[0]));
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
 	}
 
 	if ((argc - optind) != 3) {
-		printf(usage, basename(argv[0]));
+		printf(usage, basename(argv[0]), basename(argv[0]));
 		exit(1);
 	}
 
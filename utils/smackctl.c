@@ -34,24 +34,34 @@ static const char usage[] =
 	"options:\n"
 	" -v --version       output version information and exit\n"
 	" -h --help          output usage information and exit\n"
+	" -d --diff          with apply, write only the rules that differ\n"
+	"                    from the ones in the kernel\n"
+	" -s --stats         with apply, print statistics of the rules and\n"
+	"                    of applying them\n"
 	"actions:\n"
 	" apply   apply all the rules found in the configuration directory's\n"
 	" clear   remove all system rules from the kernel\n"
+	" dump    write the rules loaded in the kernel to standard output\n"
 	" status  show the status of the Smack system, specifically if "
 	       "smackfs is mounted\n"
 	" test    test if Smack is active (exit 0) or inactive (exit 1).\n"
 ;
 
-static const char short_options[] = "vh";
+static const char short_options[] = "vhds";
 
 static struct option options[] = {
 	{"version", no_argument, NULL, 'v'},
 	{"help", no_argument, NULL, 'h'},
+	{"diff", no_argument, NULL, 'd'},
+	{"stats", no_argument, NULL, 's'},
 	{NULL, 0, NULL, 0}
 };
 
 int main(int argc, char **argv)
 {
+	const char *action;
+	int diff = 0;
+	int stats = 0;
 	int c;
 
 	for ( ; ; ) {
@@ -61,6 +71,12 @@ int main(int argc, char **argv)
 			break;
 
 		switch (c) {
+		case 'd':
+			diff = 1;
+			break;
+		case 's':
+			stats = 1;
+			break;
 		case 'v':
 			printf("%s (libsmack) version " PACKAGE_VERSION "\n",
 			       basename(argv[0]));
@@ -79,24 +95,28 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (!strcmp(argv[1], "apply")) {
-		if (smack_load_policy())
+	action = argv[optind];
+	if (!strcmp(action, "apply")) {
+		if (load_policy(diff, stats))
 			exit(1);
-	} else if (!strcmp(argv[1], "clear")) {
+	} else if (!strcmp(action, "clear")) {
 		if (clear())
 			exit(1);
-	} else if (!strcmp(argv[1], "status")) {
+	} else if (!strcmp(action, "dump")) {
+		if (dump_rules())
+			exit(1);
+	} else if (!strcmp(action, "status")) {
 		if (smack_smackfs_path())
 			printf("SmackFS is mounted to %s\n",
 			       smack_smackfs_path());
 		else
 			printf("SmackFS is not mounted.\n");
 		exit(0);
-	} else if (!strcmp(argv[1], "test")) {
+	} else if (!strcmp(action, "test")) {
 		if (!smack_smackfs_path())
 			exit(2);
 	} else {
-		fprintf(stderr, "Unknown action: %s\n", argv[1]);
+		fprintf(stderr, "Unknown action: %s\n", action);
 		fprintf(stderr, usage, argv[0]);
 		exit(1);
 	}
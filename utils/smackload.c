@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/smack.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -34,20 +36,38 @@ static const char usage[] =
 	" -v --version       output version information and exit\n"
 	" -h --help          output usage information and exit\n"
 	" -c --clear         clear access rules\n"
+	" -j --jobs=N        read and parse with N threads (0: one per CPU)\n"
+	" -o --compile=FILE  write the rules to FILE as a compiled image\n"
+	" -b --binary        read rules from compiled images\n"
+	" -s --stream=SIZE   apply rules while reading, in batches of about\n"
+	"                    SIZE MiB\n"
+	" -S --stats         print statistics of the rules and of applying them\n"
 ;
 
-static const char short_options[] = "vhc";
+static const char short_options[] = "vhcj:o:bs:S";
 
 static struct option options[] = {
 	{"version", no_argument, 0, 'v'},
 	{"help", no_argument, 0, 'h'},
 	{"clear", no_argument, 0, 'c'},
+	{"jobs", required_argument, 0, 'j'},
+	{"compile", required_argument, 0, 'o'},
+	{"binary", no_argument, 0, 'b'},
+	{"stream", required_argument, 0, 's'},
+	{"stats", no_argument, 0, 'S'},
 	{NULL, 0, 0, 0}
 };
 
 int main(int argc, char **argv)
 {
 	int clear = 0;
+	long jobs = 1;
+	int binary = 0;
+	long stream = 0;
+	int stats = 0;
+	const char *image = NULL;
+	const char *path = NULL;
+	char *end;
 	int c;
 
 	for ( ; ; ) {
@@ -60,6 +80,33 @@ int main(int argc, char **argv)
 		case 'c':
 			clear = 1;
 			break;
+		case 'j':
+			jobs = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || jobs < 0 ||
+			    jobs > INT_MAX) {
+				fprintf(stderr, "Invalid number of jobs '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			image = optarg;
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 's':
+			stream = strtol(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0' || stream <= 0 ||
+			    (unsigned long) stream > SIZE_MAX >> 20) {
+				fprintf(stderr, "Invalid stream size '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'S':
+			stats = 1;
+			break;
 		case 'v':
 			printf("%s (libsmack) version " PACKAGE_VERSION "\n",
 			       basename(argv[0]));
@@ -73,21 +120,35 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (!smack_smackfs_path()) {
-		fprintf(stderr, "SmackFS is not mounted.\n");
+	if ((argc - optind) > 1 || (image && (clear || binary)) ||
+	    (stream && (image || binary || stats))) {
+		printf(usage, basename(argv[0]));
 		exit(1);
 	}
 
-	if ((argc - optind) > 1) {
-		printf(usage, basename(argv[0]));
+	if (optind < argc)
+		path = argv[optind];
+
+	/* Compiling does not touch the kernel */
+	if (image) {
+		if (compile_rules(path, image, (int) jobs))
+			exit(1);
+		exit(0);
+	}
+
+	if (!smack_smackfs_path()) {
+		fprintf(stderr, "SmackFS is not mounted.\n");
 		exit(1);
 	}
 
-	if (optind == argc) {
-		if (apply_rules(NULL, clear))
+	if (binary) {
+		if (apply_compiled(path, clear, stats))
+			exit(1);
+	} else if (stream) {
+		if (apply_rules_stream(path, clear, (size_t) stream << 20))
 			exit(1);
 	} else {
-		if (apply_rules(argv[optind], clear))
+		if (apply_rules(path, clear, (int) jobs, stats))
 			exit(1);
 	}
 